@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+"""Compare two load test result sets written by bench/loadtest.sh."""
+
+import os
+import sys
+
+FIELDS = ["rps", "p50_us", "p99_us", "p999_us", "rss_avg_kb", "errors"]
+
+
+def load(directory):
+    results = {}
+    for name in sorted(os.listdir(directory)):
+        if not name.endswith(".txt"):
+            continue
+        values = {}
+        with open(os.path.join(directory, name)) as f:
+            for line in f:
+                parts = line.split()
+                if len(parts) == 2:
+                    values[parts[0]] = parts[1]
+        results[name[:-4]] = values
+    return results
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write("usage: %s BASE_DIR NEW_DIR\n" % sys.argv[0])
+        return 1
+
+    base = load(sys.argv[1])
+    new = load(sys.argv[2])
+
+    print("%-20s %-12s %12s %12s %9s" % ("run", "metric", "base", "new",
+                                         "delta"))
+    for run in sorted(set(base) & set(new)):
+        for field in FIELDS:
+            if field not in base[run] or field not in new[run]:
+                continue
+            a = float(base[run][field])
+            b = float(new[run][field])
+            delta = ((b - a) / a * 100.0) if a else 0.0
+            print("%-20s %-12s %12.1f %12.1f %+8.1f%%" % (run, field, a, b,
+                                                         delta))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,200 @@
+#!/bin/bash
+#
+# Load test mod_identicon on a local httpd for each MPM and cache setup.
+#
+#   bench/loadtest.sh [-l LABEL] [-m MPMS] [-c CACHES] [-d SEC] [-C CONNS]
+#
+# Results are written to bench/results/LABEL/<mpm>-<cache>.txt and can be
+# compared with bench/compare.py.
+
+set -e
+
+BENCH_DIR=$(cd $(dirname $0) && pwd)
+TOP_DIR=$(dirname ${BENCH_DIR})
+
+# Defaults
+LABEL=$(cd ${TOP_DIR} && git rev-parse --short HEAD 2> /dev/null || date +%Y%m%d%H%M%S)
+MPMS="prefork worker event"
+CACHES="none local shmcb memcache"
+DURATION=30
+WARMUP=5
+CONNECTIONS=128
+THREADS=$(nproc 2> /dev/null || echo 4)
+PORT=8089
+MEMCACHED_PORT=21211
+APXS=${APXS:-apxs}
+MODULE=${TOP_DIR}/.libs/mod_identicon.so
+URLS_ARGS=""
+
+usage() {
+    cat <<EOT
+usage: $0 [OPTION]
+  -l LABEL    result label [default: git revision]
+  -m MPMS     MPMs to test [default: ${MPMS}]
+  -c CACHES   cache setups: none local shmcb dbm socache-memcache memcache
+              [default: ${CACHES}]
+  -d SEC      duration of each run [default: ${DURATION}]
+  -w SEC      unrecorded warm-up of each run [default: ${WARMUP}]
+  -C CONNS    concurrent connections [default: ${CONNECTIONS}]
+  -T THREADS  wrk threads [default: ${THREADS}]
+  -p PORT     httpd port [default: ${PORT}]
+  -M MODULE   mod_identicon.so [default: ${MODULE}]
+  -u ARGS     arguments for bench/urls.py (e.g. "-z 0.9 -t 0.5")
+EOT
+    exit 1
+}
+
+while getopts "l:m:c:d:w:C:T:p:M:u:h" opt; do
+    case ${opt} in
+        l) LABEL=${OPTARG} ;;
+        m) MPMS=${OPTARG} ;;
+        c) CACHES=${OPTARG} ;;
+        d) DURATION=${OPTARG} ;;
+        w) WARMUP=${OPTARG} ;;
+        C) CONNECTIONS=${OPTARG} ;;
+        T) THREADS=${OPTARG} ;;
+        p) PORT=${OPTARG} ;;
+        M) MODULE=${OPTARG} ;;
+        u) URLS_ARGS=${OPTARG} ;;
+        *) usage ;;
+    esac
+done
+
+for cmd in ${APXS} wrk python3; do
+    if ! command -v ${cmd} > /dev/null 2>&1; then
+        echo "$0: ${cmd} not found" >&2
+        exit 1
+    fi
+done
+
+if [ ! -f "${MODULE}" ]; then
+    echo "$0: ${MODULE} not found (run make first)" >&2
+    exit 1
+fi
+
+HTTPD=$(${APXS} -q SBINDIR)/$(${APXS} -q TARGET)
+MODULES=$(${APXS} -q LIBEXECDIR)
+RESULT_DIR=${BENCH_DIR}/results/${LABEL}
+WORK_DIR=$(mktemp -d)
+URLS=${WORK_DIR}/urls.txt
+
+mkdir -p ${RESULT_DIR}
+
+cleanup() {
+    if [ -f ${WORK_DIR}/httpd.pid ]; then
+        ${HTTPD} -f ${WORK_DIR}/httpd.conf -k stop 2> /dev/null || true
+    fi
+    if [ -f ${WORK_DIR}/memcached.pid ]; then
+        kill $(cat ${WORK_DIR}/memcached.pid) 2> /dev/null || true
+    fi
+    rm -rf ${WORK_DIR}
+}
+trap cleanup EXIT
+
+echo "Generating request paths"
+python3 ${BENCH_DIR}/urls.py ${URLS_ARGS} -o ${URLS}
+
+start_memcached() {
+    if ! command -v memcached > /dev/null 2>&1; then
+        echo "memcached not found" >&2
+        return 1
+    fi
+    memcached -d -l 127.0.0.1 -p ${MEMCACHED_PORT} -U 0 -m 256 \
+              -u $(id -un) -P ${WORK_DIR}/memcached.pid
+}
+
+# cache setup: modules and directives
+cache_conf() {
+    CACHE_MODULES=""
+    CACHE_CONF=""
+    case $1 in
+        none)
+            ;;
+        local)
+            CACHE_CONF="IdenticonLocalCache 4096"
+            ;;
+        shmcb)
+            CACHE_MODULES="LoadModule socache_shmcb_module ${MODULES}/mod_socache_shmcb.so"
+            CACHE_CONF="IdenticonCache shmcb:${WORK_DIR}/identicon_cache(16777216)"
+            ;;
+        dbm)
+            CACHE_MODULES="LoadModule socache_dbm_module ${MODULES}/mod_socache_dbm.so"
+            CACHE_CONF="IdenticonCache dbm:${WORK_DIR}/identicon_cache"
+            ;;
+        socache-memcache)
+            start_memcached || return 1
+            CACHE_MODULES="LoadModule socache_memcache_module ${MODULES}/mod_socache_memcache.so"
+            CACHE_CONF="IdenticonCache memcache:127.0.0.1:${MEMCACHED_PORT}"
+            ;;
+        memcache)
+            start_memcached || return 1
+            CACHE_CONF="IdenticonMemcacheHost 127.0.0.1:${MEMCACHED_PORT}"
+            ;;
+        *)
+            echo "unknown cache setup: $1" >&2
+            return 1
+            ;;
+    esac
+}
+
+child_rss() {
+    local pid=$(cat ${WORK_DIR}/httpd.pid)
+    ps -o rss= --ppid ${pid} | awk '
+        { sum += $1; n++; if ($1 > max) max = $1 }
+        END { if (n) printf "children %d\nrss_avg_kb %d\nrss_max_kb %d\n",
+                            n, sum / n, max }'
+}
+
+for mpm in ${MPMS}; do
+    for cache in ${CACHES}; do
+        run=${mpm}-${cache}
+        echo "Running ${run}"
+
+        if ! cache_conf ${cache}; then
+            echo "Skipping ${run}"
+            continue
+        fi
+
+        sed -e "s|@ROOT@|${WORK_DIR}|g" \
+            -e "s|@PORT@|${PORT}|g" \
+            -e "s|@MPM@|${mpm}|g" \
+            -e "s|@MODULES@|${MODULES}|g" \
+            -e "s|@MODULE@|${MODULE}|g" \
+            -e "s|@USER@|$(id -un)|g" \
+            -e "s|@CACHE_MODULES@|${CACHE_MODULES}|g" \
+            -e "s|@CACHE_CONF@|${CACHE_CONF}|g" \
+            ${BENCH_DIR}/httpd.conf.in > ${WORK_DIR}/httpd.conf
+
+        ${HTTPD} -f ${WORK_DIR}/httpd.conf -k start
+        sleep 2
+
+        if [ ${WARMUP} -gt 0 ]; then
+            wrk -t ${THREADS} -c ${CONNECTIONS} -d ${WARMUP}s \
+                -s ${BENCH_DIR}/wrk.lua http://127.0.0.1:${PORT} \
+                -- ${URLS} ${THREADS} > /dev/null
+        fi
+
+        {
+            echo "mpm ${mpm}"
+            echo "cache ${cache}"
+            wrk -t ${THREADS} -c ${CONNECTIONS} -d ${DURATION}s \
+                -s ${BENCH_DIR}/wrk.lua http://127.0.0.1:${PORT} \
+                -- ${URLS} ${THREADS} | grep -E '^(requests|errors|rps|p[0-9]+_us) '
+            child_rss
+        } > ${RESULT_DIR}/${run}.txt
+
+        ${HTTPD} -f ${WORK_DIR}/httpd.conf -k stop
+        while [ -f ${WORK_DIR}/httpd.pid ]; do
+            sleep 1
+        done
+
+        if [ -f ${WORK_DIR}/memcached.pid ]; then
+            kill $(cat ${WORK_DIR}/memcached.pid) 2> /dev/null || true
+            rm -f ${WORK_DIR}/memcached.pid
+        fi
+
+        cat ${RESULT_DIR}/${run}.txt
+    done
+done
+
+echo "Results: ${RESULT_DIR}"
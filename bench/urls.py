@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""Generate identicon request paths for the load test.
+
+Hash popularity follows a Zipf distribution, sizes are drawn from a
+weighted set and a fraction of requests ask for a transparent image.
+"""
+
+import argparse
+import bisect
+import hashlib
+import random
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("-n", "--requests", type=int, default=200000,
+                        help="number of paths to generate")
+    parser.add_argument("-u", "--users", type=int, default=100000,
+                        help="number of distinct hashes")
+    parser.add_argument("-z", "--zipf", type=float, default=1.1,
+                        help="zipf exponent of hash popularity")
+    parser.add_argument("-s", "--sizes", default="32:4,64:3,80:2,96:1",
+                        help="size:weight list")
+    parser.add_argument("-t", "--transparent", type=float, default=0.2,
+                        help="fraction of requests with t=1")
+    parser.add_argument("--seed", type=int, default=1,
+                        help="random seed (keeps runs comparable)")
+    parser.add_argument("-o", "--output", default="-",
+                        help="output file")
+    args = parser.parse_args()
+
+    rnd = random.Random(args.seed)
+
+    cumulative = []
+    total = 0.0
+    for rank in range(1, args.users + 1):
+        total += 1.0 / (rank ** args.zipf)
+        cumulative.append(total)
+
+    sizes = []
+    weights = []
+    for item in args.sizes.split(","):
+        size, weight = item.split(":")
+        sizes.append(int(size))
+        weights.append(float(weight))
+
+    out = open(args.output, "w") if args.output != "-" else None
+    for _ in range(args.requests):
+        rank = bisect.bisect_left(cumulative, rnd.random() * total)
+        user = hashlib.md5(("user-%d" % rank).encode()).hexdigest()
+        size = rnd.choices(sizes, weights)[0]
+        path = "/identicon?u=%s&s=%d" % (user, size)
+        if rnd.random() < args.transparent:
+            path += "&t=1"
+        if out:
+            out.write(path + "\n")
+        else:
+            print(path)
+    if out:
+        out.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,45 @@
+-- wrk script: replay request paths from a file and report percentiles
+--
+--   wrk -t THREADS -s bench/wrk.lua http://127.0.0.1:8089 -- urls.txt THREADS
+--
+-- setup() and init() run in turn for each thread, so the number of
+-- threads is passed as a script argument.
+
+local threads = {}
+local counter = 1
+
+function setup(thread)
+    thread:set("id", #threads + 1)
+    table.insert(threads, thread)
+end
+
+function init(args)
+    urls = {}
+    for line in io.lines(args[1]) do
+        urls[#urls + 1] = line
+    end
+    -- spread the threads over the list
+    local nthreads = tonumber(args[2]) or 1
+    counter = math.floor(#urls / nthreads * ((id or 1) - 1)) % #urls + 1
+end
+
+function request()
+    local path = urls[counter]
+    counter = counter + 1
+    if counter > #urls then
+        counter = 1
+    end
+    return wrk.format("GET", path)
+end
+
+function done(summary, latency, requests)
+    local errors = summary.errors.connect + summary.errors.read +
+        summary.errors.write + summary.errors.status + summary.errors.timeout
+    io.write(string.format("requests %d\n", summary.requests))
+    io.write(string.format("errors %d\n", errors))
+    io.write(string.format("rps %.1f\n",
+                           summary.requests / (summary.duration / 1e6)))
+    io.write(string.format("p50_us %d\n", latency:percentile(50)))
+    io.write(string.format("p99_us %d\n", latency:percentile(99)))
+    io.write(string.format("p999_us %d\n", latency:percentile(99.9)))
+end
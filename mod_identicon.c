@@ -25,17 +25,59 @@
 #include "util_script.h"
 #include "ap_config.h"
 #include "apr_strings.h"
+#include "apr_lib.h"
 #include "util_md5.h"
+#include "util_mutex.h"
+#include "ap_provider.h"
+#include "ap_socache.h"
+#include "apr_global_mutex.h"
+#include "apr_shm.h"
+#include "apr_atomic.h"
+#include "apr_file_io.h"
+#include "apr_mmap.h"
+#include "apr_optional.h"
+#include "apr_signal.h"
+#include "apr_thread_proc.h"
+#include "ap_mpm.h"
+#include "ap_listen.h"
+#include "mpm_common.h"
+#include "unixd.h"
+#include "mod_identicon.h"
+
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_pool.h"
+#endif
 
+#ifdef IDENTICON_HAVE_APREQ2
 /* apreq2 */
 #include "apreq2/apreq_module_apache2.h"
+#endif
 
 /* gd */
 #include <gd.h>
 
+#include <limits.h>
+
+/* render daemon */
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
 #ifdef IDENTICON_HAVE_MEMCACHE
 /* libmemcached */
 #include "memcached.h"
+#include <libmemcached/util.h>
+#endif
+
+#ifdef IDENTICON_HAVE_USDT
+/* static tracepoints (systemtap sdt) */
+#include <sys/sdt.h>
 #endif
 
 
@@ -68,11 +110,88 @@
                   p, "[IDENTICON_DEBUG] %s(%d): "format,    \
                   __FILE__, __LINE__, ##args)
 
+/* probes: nops unless a tracer is attached (see tools/bpftrace) */
+#ifdef IDENTICON_HAVE_USDT
+#define IDENTICON_PROBE1(name, a1) DTRACE_PROBE1(identicon, name, a1)
+#define IDENTICON_PROBE2(name, a1, a2) DTRACE_PROBE2(identicon, name, a1, a2)
+#define IDENTICON_PROBE3(name, a1, a2, a3)      \
+    DTRACE_PROBE3(identicon, name, a1, a2, a3)
+#define IDENTICON_PROBE4(name, a1, a2, a3, a4)      \
+    DTRACE_PROBE4(identicon, name, a1, a2, a3, a4)
+#else
+#define IDENTICON_PROBE1(name, a1)
+#define IDENTICON_PROBE2(name, a1, a2)
+#define IDENTICON_PROBE3(name, a1, a2, a3)
+#define IDENTICON_PROBE4(name, a1, a2, a3, a4)
+#endif
+
 #define IDENTICON_CONTENT_TYPE "image/png"
+#define IDENTICON_QOI_CONTENT_TYPE "image/qoi"
+#define IDENTICON_RGBA_CONTENT_TYPE "image/x-rgba"
 #define IDENTICON_DEFAULT_HASH "098f6bcd4621d373cade4e832627b4f6"
 #define IDENTICON_DEFAULT_SIZE 80
+#define IDENTICON_MAX_SIZE 100000
 #define IDENTICON_IMAGE_SPRITE 128
 #define IDENTICON_DEFAULT_MEMCACHE_EXPIRE 0
+#define IDENTICON_DEFAULT_MEMCACHE_RETRY 30
+#define IDENTICON_MEMCACHE_HANDLE "identicon_memcache_handle"
+#define IDENTICON_DEFAULT_COALESCE 1
+#define IDENTICON_DEFAULT_COALESCE_WAIT 1000
+#define IDENTICON_COALESCE_POLL 10
+#define IDENTICON_LEASE_PREFIX "lease:"
+#define IDENTICON_DEFAULT_LOCAL_CACHE 0
+#define IDENTICON_DEFAULT_CACHE_EXPIRE 86400
+#define IDENTICON_SOCACHE_MUTEX "identicon-socache"
+#define IDENTICON_SOCACHE_MAX_SIZE 65536
+#define IDENTICON_SOCACHE_BUFFER "identicon_socache_buffer"
+#define IDENTICON_STATUS_CONTENT_TYPE "text/plain; charset=ISO-8859-1"
+#define IDENTICON_DEFAULT_RETRY_AFTER 5
+
+#define IDENTICON_PNG_DEFAULT -1
+#define IDENTICON_PNG_FAST 1
+#define IDENTICON_PNG_BEST 9
+#define IDENTICON_PNG_ADAPTIVE -2
+#define IDENTICON_PNG_LONG_EXPIRE 3600
+#define IDENTICON_PNG_DIRECT_MAX 1024
+
+#define IDENTICON_DEFAULT_RENDER_THREADS 0
+/* unmeasured guess: below this, thread handoff likely costs more */
+#define IDENTICON_DEFAULT_PARALLEL_SIZE 512
+#define IDENTICON_MAX_RENDER_THREADS 16
+
+#define IDENTICON_CLIENT_HINTS "Sec-CH-DPR, Sec-CH-Width, Sec-CH-Viewport-Width, DPR, Width, Viewport-Width"
+#define IDENTICON_MAX_DPR 4.0
+
+#define IDENTICON_SNAPSHOT_MAGIC "IDNTSNAP"
+#define IDENTICON_SNAPSHOT_VERSION 1
+
+#define IDENTICON_DAEMON_VERSION 2
+#define IDENTICON_DEFAULT_DAEMON_THREADS 8
+#define IDENTICON_DEFAULT_DAEMON_CACHE 4096
+#define IDENTICON_DAEMON_TIMEOUT 5
+#define IDENTICON_DAEMON_BACKLOG 128
+#define IDENTICON_DAEMON_USER_MAX 1024
+#define IDENTICON_DAEMON_DATA_MAX (64 * 1024 * 1024)
+#define IDENTICON_DAEMON_MIN_UPTIME 10
+#define IDENTICON_DAEMON_MAX_FAILURES 5
+#define IDENTICON_DAEMON_MAX_BACKOFF 16
+
+#define IDENTICON_SKETCH_DEPTH 4
+#define IDENTICON_SKETCH_MAX (1 << 24)
+#define IDENTICON_SKETCH_AGE_SLICE 64
+#define IDENTICON_DEFAULT_ADMISSION_MIN 2
+
+#define IDENTICON_ADMIT_LOCAL  0x01
+#define IDENTICON_ADMIT_SHARED 0x02
+#define IDENTICON_ADMIT_ALL    (IDENTICON_ADMIT_LOCAL | IDENTICON_ADMIT_SHARED)
+
+#define IDENTICON_FORMAT_PNG  0
+#define IDENTICON_FORMAT_QOI  1
+#define IDENTICON_FORMAT_RGBA 2
+
+#define IDENTICON_FALLBACK_BUSY    0
+#define IDENTICON_FALLBACK_DEFAULT 1
+#define IDENTICON_FALLBACK_SMALLER 2
 
 typedef struct {
     int shape;
@@ -92,14 +211,250 @@ typedef struct {
     int background;
 } identicon_image_t;
 
-#ifdef IDENTICON_HAVE_MEMCACHE
 typedef struct {
+    int level;
+    int palette;
+    size_t parallel;
+    size_t direct;
+    int format;
+} identicon_encode_t;
+
+typedef struct {
+    const char *user;
+    apr_size_t user_len;
+    size_t size;
+    int trans;
+    int format;
+} identicon_args_t;
+
+typedef struct {
+    char *user;
+    size_t size;
+    int trans;
+    int format;
+    char *key;
+    char *etag;
+} identicon_request_t;
+
+typedef struct {
+    char *user;
+    size_t size;
+} identicon_warm_t;
+
+typedef struct {
+    int coalesce;
+    apr_interval_time_t coalesce_wait;
+    apr_array_header_t *sizes;
+    int local_cache;
+    char *warm_list;
+    char *snapshot;
+    apr_array_header_t *warm;
+    char *quick_handler;
+    int siblings;
+    const char *socache_name;
+    const ap_socache_provider_t *socache;
+    ap_socache_instance_t *socache_instance;
+    apr_interval_time_t socache_expire;
+    apr_uint32_t render_limit;
+    apr_uint32_t render_server_limit;
+    int render_fallback;
+    int retry_after;
+    int png_level;
+    int png_palette;
+    size_t png_direct;
+    apr_uint32_t admission;
+    apr_uint32_t admission_min;
+    int render_threads;
+    size_t parallel_size;
+    int client_hints;
+    char *daemon;
+    int daemon_threads;
+#ifdef IDENTICON_HAVE_MEMCACHE
     apr_pool_t *pool;
     char *hosts;
     time_t expire;
+    int ketama;
+    int replicas;
+    int failure_limit;
+    int retry;
+    int binary;
     struct memcached_st *memc;
-    struct memcached_server_st *servers;
+    memcached_pool_st *memc_pool;
+#endif
 } identicon_server_config_t;
+
+typedef struct {
+    int raw_formats;
+} identicon_dir_config_t;
+
+#if APR_HAS_THREADS
+typedef struct {
+    char *key;
+    int done;
+    int refs;
+    char *data;
+    int length;
+} identicon_flight_t;
+
+/* in-flight renders of this child, keyed by cache key */
+static apr_thread_mutex_t *identicon_flight_mutex = NULL;
+static apr_thread_cond_t *identicon_flight_cond = NULL;
+static apr_hash_t *identicon_flights = NULL;
+#endif
+
+typedef struct identicon_entry_t identicon_entry_t;
+
+struct identicon_entry_t {
+    char *key;
+    char *data;
+    int length;
+    identicon_entry_t *prev;
+    identicon_entry_t *next;
+};
+
+/* per-child LRU cache */
+typedef struct {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    apr_hash_t *entries;
+    identicon_entry_t *head;
+    identicon_entry_t *tail;
+    int count;
+    int max;
+} identicon_local_cache_t;
+
+static identicon_local_cache_t *identicon_local = NULL;
+
+/*
+ * Local cache snapshot file: header, then entries from least to most
+ * recently used. Integers are in host byte order.
+ */
+typedef struct {
+    char magic[8];
+    apr_uint32_t version;
+    apr_uint32_t count;
+} identicon_snapshot_header_t;
+
+typedef struct {
+    apr_uint32_t key_len;
+    apr_uint32_t data_len;
+} identicon_snapshot_entry_t;
+
+typedef struct {
+    identicon_local_cache_t *cache;
+    server_rec *server;
+    const char *path;
+} identicon_snapshot_t;
+
+/* serializes socache providers that are not multi-process safe */
+static apr_global_mutex_t *identicon_socache_mutex = NULL;
+
+/*
+ * In-flight renders of one child for IdenticonRenderServerLimit, claimed
+ * by pid. The parent clears the slot of a child that dies mid-render.
+ */
+typedef struct {
+    apr_uint32_t pid;
+    apr_uint32_t renders;
+} identicon_render_slot_t;
+
+/* counters shared by all children, followed by the render slots */
+typedef struct {
+    apr_uint32_t slots;
+    apr_uint32_t snapshot_pid;
+    apr_uint32_t rendered;
+    apr_uint32_t rejected;
+    apr_uint32_t fallback_default;
+    apr_uint32_t fallback_smaller;
+    apr_uint32_t fallback_busy;
+    apr_uint32_t lookups;
+    apr_uint32_t hits;
+    apr_uint32_t admitted;
+    apr_uint32_t admission_rejected;
+    apr_uint32_t local_rejected;
+} identicon_stats_t;
+
+static identicon_stats_t *identicon_stats = NULL;
+static identicon_render_slot_t *identicon_render_slots = NULL;
+
+/* render slot of this child */
+static identicon_render_slot_t *identicon_render_slot = NULL;
+
+/*
+ * Count-min sketch of key frequencies shared by all children
+ * (IDENTICON_SKETCH_DEPTH rows of width counters). Counters are halved
+ * every 10 * width samples, so old popularity fades (TinyLFU). A halving
+ * round is spread over the following requests: each halves the next
+ * slice from the cursor.
+ */
+typedef struct {
+    apr_uint32_t width;
+    apr_uint32_t samples;
+    apr_uint32_t cursor;
+} identicon_sketch_t;
+
+static identicon_sketch_t *identicon_sketch = NULL;
+static apr_uint32_t *identicon_sketch_counters = NULL;
+
+/* renders running in this child */
+static apr_uint32_t identicon_renders = 0;
+
+/*
+ * Render daemon protocol: one request per connection, a request header
+ * followed by the hash, answered by a response header and the png.
+ */
+typedef struct {
+    apr_uint32_t version;
+    apr_uint32_t size;
+    apr_uint32_t trans;
+    apr_int32_t level;
+    apr_uint32_t palette;
+    apr_uint32_t format;
+    apr_uint32_t user_len;
+} identicon_daemon_request_t;
+
+typedef struct {
+    apr_int32_t status;
+    apr_uint32_t length;
+} identicon_daemon_response_t;
+
+typedef struct {
+    identicon_server_config_t *cfg;
+    int fd;
+} identicon_daemon_conn_t;
+
+static const char *identicon_daemon_sock = NULL;
+static apr_pool_t *identicon_daemon_pool = NULL;
+static server_rec *identicon_daemon_server = NULL;
+static volatile sig_atomic_t identicon_daemon_exit = 0;
+/* parent: daemon deaths right after starting, and the last start time */
+static int identicon_daemon_failures = 0;
+static apr_time_t identicon_daemon_started = 0;
+
+#if APR_HAS_THREADS
+typedef struct identicon_task_t identicon_task_t;
+
+struct identicon_task_t {
+    int (*run)(identicon_task_t *task);
+    identicon_image_t *image;
+    gdImagePtr dst;
+    int y0;
+    int y1;
+    int ret;
+    int *pending;
+};
+
+/* per-child pool for tiles of large renders */
+static apr_thread_pool_t *identicon_thread_pool = NULL;
+static apr_thread_mutex_t *identicon_task_mutex = NULL;
+static apr_thread_cond_t *identicon_task_cond = NULL;
+static int identicon_thread_bands = 1;
+#endif
+
+#if APR_HAS_THREADS
+static apr_thread_t *identicon_warm_thread = NULL;
+static volatile int identicon_warm_stop = 0;
 #endif
 
 module AP_MODULE_DECLARE_DATA identicon_module;
@@ -449,8 +804,11 @@ identicon_image_init(identicon_image_t *image, char *hash)
 {
     image->sprite = IDENTICON_IMAGE_SPRITE;
 
+    IDENTICON_PROBE2(stage__start, "init", image->sprite * 3);
+
     image->base = gdImageCreateTrueColor(image->sprite * 3, image->sprite * 3);
     if (image->base == NULL) {
+        IDENTICON_PROBE3(stage__done, "init", image->sprite * 3, -1);
         return -1;
     }
     gdImageSetAntiAliased(image->base, 1);
@@ -478,6 +836,8 @@ identicon_image_init(identicon_image_t *image, char *hash)
     image->side.green = identicon_hexdec(hash[14], hash[15]);
     image->side.blue = identicon_hexdec(hash[16], hash[17]);
 
+    IDENTICON_PROBE3(stage__done, "init", image->sprite * 3, 0);
+
     return 0;
 }
 
@@ -596,8 +956,11 @@ identicon_generate_corner(identicon_image_t *image)
 {
     gdImagePtr img;
 
+    IDENTICON_PROBE2(stage__start, "corner", image->sprite);
+
     img = identicon_generate_circle(image, image->corner);
     if (img == NULL) {
+        IDENTICON_PROBE3(stage__done, "corner", image->sprite, -1);
         return -1;
     }
 
@@ -623,6 +986,8 @@ identicon_generate_corner(identicon_image_t *image)
 
     gdImageDestroy(img);
 
+    IDENTICON_PROBE3(stage__done, "corner", image->sprite, 0);
+
     return 0;
 }
 
@@ -631,8 +996,11 @@ identicon_generate_side(identicon_image_t *image)
 {
     gdImagePtr img;
 
+    IDENTICON_PROBE2(stage__start, "side", image->sprite);
+
     img = identicon_generate_circle(image, image->side);
     if (img == NULL) {
+        IDENTICON_PROBE3(stage__done, "side", image->sprite, -1);
         return -1;
     }
 
@@ -658,6 +1026,8 @@ identicon_generate_side(identicon_image_t *image)
 
     gdImageDestroy(img);
 
+    IDENTICON_PROBE3(stage__done, "side", image->sprite, 0);
+
     return 0;
 }
 
@@ -667,8 +1037,11 @@ identicon_generate_center(identicon_image_t *image)
     int foreground, background;
     gdImagePtr img;
 
+    IDENTICON_PROBE2(stage__start, "center", image->sprite);
+
     img = gdImageCreateTrueColor(image->sprite, image->sprite);
     if (img == NULL) {
+        IDENTICON_PROBE3(stage__done, "center", image->sprite, -1);
         return -1;
     }
     gdImageSetAntiAliased(img, 1);
@@ -719,356 +1092,4392 @@ identicon_generate_center(identicon_image_t *image)
                 image->sprite, image->sprite);
     gdImageDestroy(img);
 
-    return 0;
-}
-
-static int
-identicon_image_resize(identicon_image_t *image, int width, int height)
-{
-    if (gdImageSX(image->base) != width || gdImageSX(image->base) != height) {
-        gdImagePtr img = gdImageCreateTrueColor(width, height);
-        if (img == NULL) {
-            return -1;
-        }
-
-        gdImageCopyResized(img, image->base, 0, 0, 0, 0, width, height,
-                           gdImageSX(image->base), gdImageSY(image->base));
-        gdImageDestroy(image->base);
-        image->base = img;
-    }
+    IDENTICON_PROBE3(stage__done, "center", image->sprite, 0);
 
     return 0;
 }
 
+#if APR_HAS_THREADS
+/*
+ * Same mapping as gdImageCopyResized() (source row y covers destination
+ * rows dh*y/sh .. dh*(y+1)/sh), so bands of source rows can be scaled
+ * independently.
+ */
 static void
-identicon_image_transparent(identicon_image_t *image)
+identicon_image_resize_rows(gdImagePtr dst, gdImagePtr src, int y0, int y1)
 {
-    gdImageColorTransparent(image->base, image->background);
-}
+    int x, y, dx, dy, dx0, dx1, dy0, dy1, c, *row;
+    int sw = gdImageSX(src), sh = gdImageSY(src);
+    int dw = gdImageSX(dst), dh = gdImageSY(dst);
+
+    for (y = y0; y < y1; y++) {
+        dy0 = (int)(((long)dh * y) / sh);
+        dy1 = (int)(((long)dh * (y + 1)) / sh);
+        if (dy0 == dy1) {
+            continue;
+        }
 
-#ifdef IDENTICON_HAVE_MEMCACHE
-static apr_status_t
-memcache_cleanup(void *parms)
-{
-    identicon_server_config_t *cfg = (identicon_server_config_t *)parms;
+        row = &gdImageTrueColorPixel(dst, 0, dy0);
+        for (x = 0; x < sw; x++) {
+            dx0 = (int)(((long)dw * x) / sw);
+            dx1 = (int)(((long)dw * (x + 1)) / sw);
+            c = gdImageTrueColorPixel(src, x, y);
+            for (dx = dx0; dx < dx1; dx++) {
+                row[dx] = c;
+            }
+        }
 
-    if (!cfg) {
-        return APR_SUCCESS;
+        for (dy = dy0 + 1; dy < dy1; dy++) {
+            memcpy(&gdImageTrueColorPixel(dst, 0, dy), row, sizeof(int) * dw);
+        }
     }
+}
 
-    /* memcached cleanup */
-    if (cfg->servers) {
-        memcached_server_list_free(cfg->servers);
-        cfg->servers = NULL;
-    }
+static void * APR_THREAD_FUNC
+identicon_task_main(apr_thread_t *thd, void *parms)
+{
+    identicon_task_t *task = (identicon_task_t *)parms;
 
-    if (cfg->memc) {
-        memcached_free(cfg->memc);
-        cfg->memc = NULL;
-    }
+    task->ret = task->run(task);
 
-    if (cfg->pool) {
-        apr_pool_clear(cfg->pool);
-        cfg->pool = NULL;
-    }
+    apr_thread_mutex_lock(identicon_task_mutex);
+    (*task->pending)--;
+    apr_thread_cond_broadcast(identicon_task_cond);
+    apr_thread_mutex_unlock(identicon_task_mutex);
 
-    return APR_SUCCESS;
+    return NULL;
 }
 
-struct memcached_st *
-memcache_init(request_rec *r, time_t *expire)
+/* run tasks on the pool; the calling thread takes the first one */
+static int
+identicon_tasks_run(identicon_task_t *tasks, int num)
 {
-    identicon_server_config_t *cfg;
-
-    cfg = ap_get_module_config(r->server->module_config, &identicon_module);
+    int i, pending = 0, ret = 0;
 
-    if (!cfg->hosts) {
-        return NULL;
-    }
+    for (i = 1; i < num; i++) {
+        tasks[i].pending = &pending;
 
-    *expire = cfg->expire;
+        apr_thread_mutex_lock(identicon_task_mutex);
+        pending++;
+        apr_thread_mutex_unlock(identicon_task_mutex);
 
-    if (cfg->memc) {
-        return cfg->memc;
-    }
+        if (apr_thread_pool_push(identicon_thread_pool, identicon_task_main,
+                                 &tasks[i], APR_THREAD_TASK_PRIORITY_NORMAL,
+                                 NULL) != APR_SUCCESS) {
+            apr_thread_mutex_lock(identicon_task_mutex);
+            pending--;
+            apr_thread_mutex_unlock(identicon_task_mutex);
 
-    cfg->memc = memcached_create(NULL);
-    if (!cfg->memc) {
-        return NULL;
+            tasks[i].ret = tasks[i].run(&tasks[i]);
+        }
     }
 
-    if (cfg->servers) {
-        memcached_server_list_free(cfg->servers);
-        cfg->servers = NULL;
-    }
+    tasks[0].ret = tasks[0].run(&tasks[0]);
 
-    cfg->servers = memcached_servers_parse(cfg->hosts);
-    if (!cfg->servers) {
-        memcached_free(cfg->memc);
-        cfg->memc = NULL;
-        return NULL;
+    apr_thread_mutex_lock(identicon_task_mutex);
+    while (pending > 0) {
+        apr_thread_cond_wait(identicon_task_cond, identicon_task_mutex);
     }
+    apr_thread_mutex_unlock(identicon_task_mutex);
 
-    if (memcached_server_push(cfg->memc, cfg->servers) != MEMCACHED_SUCCESS) {
-        memcached_server_list_free(cfg->servers);
-        memcached_free(cfg->memc);
-        cfg->servers = NULL;
-        cfg->memc = NULL;
-        return NULL;
+    for (i = 0; i < num; i++) {
+        if (tasks[i].ret != 0) {
+            ret = -1;
+        }
     }
 
-    /* cleanup */
-    apr_pool_cleanup_register(cfg->pool, (void *)cfg, memcache_cleanup,
-                              apr_pool_cleanup_null);
+    return ret;
+}
 
-    return cfg->memc;
+static int
+identicon_task_resize(identicon_task_t *task)
+{
+    identicon_image_resize_rows(task->dst, task->image->base,
+                                task->y0, task->y1);
+    return 0;
 }
+#endif
 
-static char *
-memcache_get(struct memcached_st *memc, request_rec *r, int *length)
+/* scaled copy of the base image; the base is kept for other sizes */
+static gdImagePtr
+identicon_image_resize(identicon_image_t *image, int width, int height,
+                       int parallel)
 {
-    char *key, *ret = NULL;
-    size_t key_len, ret_len;
-    memcached_return rc;
+    gdImagePtr img;
+#if APR_HAS_THREADS
+    identicon_task_t tasks[IDENTICON_MAX_RENDER_THREADS + 1];
+    int i, bands, rows;
+#endif
+
+    IDENTICON_PROBE2(stage__start, "resize", width);
 
-    if (!memc || !r) {
+    img = gdImageCreateTrueColor(width, height);
+    if (img == NULL) {
+        IDENTICON_PROBE3(stage__done, "resize", width, -1);
         return NULL;
     }
 
-    key = ap_md5(r->pool, (const unsigned char *)r->unparsed_uri);
-    key_len = strlen(key);
-
-    ret = memcached_get(memc, key, key_len, &ret_len, (uint16_t)0, &rc);
-    if (rc != MEMCACHED_SUCCESS) {
-        if (ret) {
-            free(ret);
+#if APR_HAS_THREADS
+    if (parallel && identicon_thread_pool &&
+        (gdImageSX(image->base) != width || gdImageSY(image->base) != height)) {
+        /* bands of source rows */
+        bands = identicon_thread_bands;
+        rows = (gdImageSY(image->base) + bands - 1) / bands;
+
+        memset(tasks, 0, sizeof(tasks));
+        for (i = 0; i < bands; i++) {
+            tasks[i].run = identicon_task_resize;
+            tasks[i].image = image;
+            tasks[i].dst = img;
+            tasks[i].y0 = i * rows;
+            tasks[i].y1 = (i + 1) * rows;
+            if (tasks[i].y1 > gdImageSY(image->base)) {
+                tasks[i].y1 = gdImageSY(image->base);
+            }
         }
-        *length = 0;
-        return NULL;
+
+        identicon_tasks_run(tasks, bands);
+
+        IDENTICON_PROBE3(stage__done, "resize", width, 0);
+
+        return img;
     }
+#endif
 
-    *length = (int)ret_len;
+    if (gdImageSX(image->base) != width || gdImageSY(image->base) != height) {
+        gdImageCopyResized(img, image->base, 0, 0, 0, 0, width, height,
+                           gdImageSX(image->base), gdImageSY(image->base));
+    } else {
+        gdImageCopy(img, image->base, 0, 0, 0, 0, width, height);
+    }
 
-    return ret;
+    IDENTICON_PROBE3(stage__done, "resize", width, 0);
+
+    return img;
 }
 
-static apr_status_t
-memcache_set(struct memcached_st *memc, request_rec *r,
-             char *data, int length, time_t expire)
+static void
+identicon_image_transparent(identicon_image_t *image, gdImagePtr img)
 {
-    char *key;
-    size_t key_len;
-    time_t now;
-    struct tm *lt;
+    gdImageColorTransparent(img, image->background);
+}
 
-    if (!memc || !r) {
-        return APR_EGENERAL;
-    }
 
-    key = ap_md5(r->pool, (const unsigned char *)r->unparsed_uri);
-    key_len = strlen(key);
+#if APR_HAS_THREADS
+static int
+identicon_task_corner(identicon_task_t *task)
+{
+    return identicon_generate_corner(task->image);
+}
 
-    if (memcached_set(memc, key, key_len, data, length,
-                      expire, (uint16_t)0) != MEMCACHED_SUCCESS) {
-        return APR_EGENERAL;
-    }
+static int
+identicon_task_side(identicon_task_t *task)
+{
+    return identicon_generate_side(task->image);
+}
 
-    return APR_SUCCESS;
+static int
+identicon_task_center(identicon_task_t *task)
+{
+    return identicon_generate_center(task->image);
 }
 #endif
 
-/* content handler */
 static int
-identicon_handler(request_rec *r)
+identicon_render_base(identicon_image_t *image, char *user, int parallel)
 {
-    char *user = NULL, *param_s = NULL, *trans = NULL;
-    size_t size = 0;
-    apreq_handle_t *apreq;
-    apr_table_t *params;
-    char *data = NULL;
-    int length;
-    identicon_image_t image;
-#ifdef IDENTICON_HAVE_MEMCACHE
-    struct memcached_st *memc = NULL;
-    time_t expire = 0;
+#if APR_HAS_THREADS
+    identicon_task_t tasks[3];
 #endif
 
-    if (strcmp(r->handler, "identicon")) {
-        return DECLINED;
-    }
-
-    if (r->header_only) {
-        return OK;
+    if (identicon_image_init(image, user) != 0) {
+        return -1;
     }
 
-    /* set contest type */
-    r->content_type = IDENTICON_CONTENT_TYPE;
-
-#ifdef IDENTICON_HAVE_MEMCACHE
-    /* memcache init */
-    memc = memcache_init(r, &expire);
+#if APR_HAS_THREADS
+    /* the cells write disjoint areas of the base image */
+    if (parallel && identicon_thread_pool) {
+        memset(tasks, 0, sizeof(tasks));
+        tasks[0].run = identicon_task_corner;
+        tasks[1].run = identicon_task_side;
+        tasks[2].run = identicon_task_center;
+        tasks[0].image = tasks[1].image = tasks[2].image = image;
+
+        if (identicon_tasks_run(tasks, 3) != 0) {
+            identicon_image_destroy(image);
+            return -1;
+        }
 
-    /* memcache get cache */
-    data = memcache_get(memc, r, &length);
-    if (data) {
-        ap_rwrite(data, length, r);
-        free(data);
-        return OK;
+        return 0;
     }
 #endif
 
-    /* get parameter */
-    apreq = apreq_handle_apache2(r);
-    params = apreq_params(apreq, r->pool);
-    if (params) {
-        user = (char *)apreq_params_as_string(r->pool, params,
-                                              "u", APREQ_JOIN_AS_IS);
-        param_s = (char *)apreq_params_as_string(r->pool, params,
-                                                 "s", APREQ_JOIN_AS_IS);
-        trans = (char *)apr_table_get(params, "t");
-        if (param_s) {
-            size = (size_t)atol(param_s);
-        }
+    if (identicon_generate_corner(image) != 0 ||
+        identicon_generate_side(image) != 0 ||
+        identicon_generate_center(image) != 0) {
+        identicon_image_destroy(image);
+        return -1;
     }
 
-    if (!user || strlen(user) < 20) {
-        user = IDENTICON_DEFAULT_HASH;
-    }
+    return 0;
+}
 
-    if (size == 0) {
-        size = IDENTICON_DEFAULT_SIZE;
-    }
+/*
+ * Exact palette copy (identicons are flat-colour); libpng writes palette
+ * images without row filters. NULL if there are more than 256 colours.
+ */
+static gdImagePtr
+identicon_image_palette(identicon_image_t *image, gdImagePtr img, int trans)
+{
+    gdImagePtr pal;
+    int x, y, c, last = -1, index = 0, transparent;
 
-    if (identicon_image_init(&image, user) != 0) {
-        return HTTP_INTERNAL_SERVER_ERROR;
+    pal = gdImageCreate(gdImageSX(img), gdImageSY(img));
+    if (pal == NULL) {
+        return NULL;
     }
 
-    if (identicon_generate_corner(&image) != 0) {
-        identicon_image_destroy(&image);
-        return HTTP_INTERNAL_SERVER_ERROR;
+    for (y = 0; y < gdImageSY(img); y++) {
+        for (x = 0; x < gdImageSX(img); x++) {
+            c = gdImageTrueColorPixel(img, x, y);
+            if (c != last) {
+                index = gdImageColorExact(pal, gdTrueColorGetRed(c),
+                                          gdTrueColorGetGreen(c),
+                                          gdTrueColorGetBlue(c));
+                if (index < 0) {
+                    index = gdImageColorAllocate(pal, gdTrueColorGetRed(c),
+                                                 gdTrueColorGetGreen(c),
+                                                 gdTrueColorGetBlue(c));
+                    if (index < 0) {
+                        gdImageDestroy(pal);
+                        return NULL;
+                    }
+                }
+                last = c;
+            }
+            gdImagePalettePixel(pal, x, y) = index;
+        }
     }
 
-    if (identicon_generate_side(&image) != 0) {
-        identicon_image_destroy(&image);
-        return HTTP_INTERNAL_SERVER_ERROR;
+    if (trans) {
+        transparent = gdImageColorExact(pal,
+                                        gdTrueColorGetRed(image->background),
+                                        gdTrueColorGetGreen(image->background),
+                                        gdTrueColorGetBlue(image->background));
+        if (transparent >= 0) {
+            gdImageColorTransparent(pal, transparent);
+        }
     }
 
-    if (identicon_generate_center(&image) != 0) {
-        identicon_image_destroy(&image);
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
+    return pal;
+}
 
-    if (identicon_image_resize(&image, size, size) != 0) {
-        identicon_image_destroy(&image);
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
+/*
+ * Direct png encoding of small images, without libpng and zlib: an 8-bit
+ * palette image in one fixed Huffman deflate block, where scanlines are
+ * copied from the previous one and runs repeat the previous pixel.
+ * Pixels decode to the same RGB (and tRNS) as gdImagePngPtrEx().
+ */
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    apr_uint32_t bits;
+    int nbits;
+} identicon_bits_t;
+
+static const apr_uint32_t identicon_crc_table[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
 
-    if (trans != NULL) {
-        identicon_image_transparent(&image);
-    }
+static const unsigned short identicon_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
 
-    /* output */
-    data = (char *)gdImagePngPtr(image.base, &length);
-    if (!data) {
-        identicon_image_destroy(&image);
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
+static const unsigned char identicon_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
 
-    ap_rwrite(data, length, r);
+static const unsigned short identicon_distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
 
-#ifdef IDENTICON_HAVE_MEMCACHE
-    /* memcache set cache */
-    memcache_set(memc, r, data, length, expire);
-#endif
+static const unsigned char identicon_distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
 
-    gdFree(data);
+static apr_uint32_t
+identicon_crc32(apr_uint32_t crc, const unsigned char *buf, size_t len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        crc = identicon_crc_table[crc & 0x0f] ^ (crc >> 4);
+        crc = identicon_crc_table[crc & 0x0f] ^ (crc >> 4);
+    }
 
-    identicon_image_destroy(&image);
+    return ~crc;
+}
+
+static apr_uint32_t
+identicon_adler32(apr_uint32_t adler, const unsigned char *buf, size_t len)
+{
+    apr_uint32_t a = adler & 0xffff, b = adler >> 16;
+    size_t n;
+
+    while (len > 0) {
+        /* largest n that cannot overflow b */
+        n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *buf++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+
+    return (b << 16) | a;
+}
+
+static void
+identicon_bits_put(identicon_bits_t *bw, apr_uint32_t value, int n)
+{
+    bw->bits |= value << bw->nbits;
+    bw->nbits += n;
+
+    while (bw->nbits >= 8) {
+        bw->buf[bw->len++] = bw->bits & 0xff;
+        bw->bits >>= 8;
+        bw->nbits -= 8;
+    }
+}
+
+/* huffman codes are packed starting from the most significant bit */
+static void
+identicon_bits_code(identicon_bits_t *bw, apr_uint32_t code, int n)
+{
+    apr_uint32_t rev = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        rev = (rev << 1) | ((code >> i) & 1);
+    }
+
+    identicon_bits_put(bw, rev, n);
+}
+
+static void
+identicon_deflate_symbol(identicon_bits_t *bw, int sym)
+{
+    if (sym < 144) {
+        identicon_bits_code(bw, 0x30 + sym, 8);
+    } else if (sym < 256) {
+        identicon_bits_code(bw, 0x190 + sym - 144, 9);
+    } else if (sym < 280) {
+        identicon_bits_code(bw, sym - 256, 7);
+    } else {
+        identicon_bits_code(bw, 0xc0 + sym - 280, 8);
+    }
+}
+
+static void
+identicon_deflate_match(identicon_bits_t *bw, int length, int distance)
+{
+    int i;
+
+    for (i = 28; identicon_length_base[i] > length; i--);
+    identicon_deflate_symbol(bw, 257 + i);
+    identicon_bits_put(bw, length - identicon_length_base[i],
+                       identicon_length_extra[i]);
+
+    for (i = 29; identicon_distance_base[i] > distance; i--);
+    identicon_bits_code(bw, i, 5);
+    identicon_bits_put(bw, distance - identicon_distance_base[i],
+                       identicon_distance_extra[i]);
+}
+
+static void
+identicon_deflate(identicon_bits_t *bw, const unsigned char *raw,
+                  size_t len, size_t stride)
+{
+    size_t i = 0, n, m, max;
+
+    /* final block, fixed huffman codes */
+    identicon_bits_put(bw, 1, 1);
+    identicon_bits_put(bw, 1, 2);
+
+    while (i < len) {
+        max = len - i;
+        if (max > 258) {
+            max = 258;
+        }
+
+        /* same bytes as the previous scanline */
+        n = 0;
+        if (i >= stride) {
+            while (n < max && raw[i + n] == raw[i + n - stride]) {
+                n++;
+            }
+        }
+
+        /* run of the previous byte */
+        m = 0;
+        if (i >= 1) {
+            while (m < max && raw[i + m] == raw[i - 1]) {
+                m++;
+            }
+        }
+
+        if (n >= 3 && n >= m) {
+            identicon_deflate_match(bw, n, stride);
+            i += n;
+        } else if (m >= 3) {
+            identicon_deflate_match(bw, m, 1);
+            i += m;
+        } else {
+            identicon_deflate_symbol(bw, raw[i]);
+            i++;
+        }
+    }
+
+    /* end of block */
+    identicon_deflate_symbol(bw, 256);
+
+    if (bw->nbits > 0) {
+        identicon_bits_put(bw, 0, 8 - bw->nbits);
+    }
+}
+
+static unsigned char *
+identicon_png_uint32(unsigned char *p, apr_uint32_t value)
+{
+    p[0] = (value >> 24) & 0xff;
+    p[1] = (value >> 16) & 0xff;
+    p[2] = (value >> 8) & 0xff;
+    p[3] = value & 0xff;
+
+    return p + 4;
+}
+
+/* length and type must be at p; data follows them */
+static unsigned char *
+identicon_png_chunk(unsigned char *p, const char *type, size_t len)
+{
+    identicon_png_uint32(p, len);
+    memcpy(p + 4, type, 4);
+
+    return identicon_png_uint32(p + 8 + len,
+                                identicon_crc32(0, p + 4, len + 4));
+}
+
+/* transparent: rgb of the transparent color, or -1 */
+static int
+identicon_png_direct(gdImagePtr img, int transparent,
+                     char **data, int *length)
+{
+    static const unsigned char signature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    int palette[256], colors = 0, index = 0, alpha = -1;
+    int w = gdImageSX(img), h = gdImageSY(img);
+    int x, y, c, last = -1;
+    size_t stride = w + 1, raw_len = stride * h;
+    unsigned char *raw, *out, *p;
+    identicon_bits_t bw;
+
+    if (w <= 0 || h <= 0 || stride > 32768) {
+        return -1;
+    }
+
+    raw = malloc(raw_len);
+    if (!raw) {
+        return -1;
+    }
+
+    /* index the pixels (filter type 0 for each scanline) */
+    for (y = 0; y < h; y++) {
+        raw[y * stride] = 0;
+        for (x = 0; x < w; x++) {
+            c = gdImageTrueColorPixel(img, x, y) & 0xffffff;
+            if (c != last) {
+                for (index = 0; index < colors; index++) {
+                    if (palette[index] == c) {
+                        break;
+                    }
+                }
+                if (index == colors) {
+                    if (colors == 256) {
+                        /* not a palette image: leave it to gd */
+                        free(raw);
+                        return -1;
+                    }
+                    palette[colors++] = c;
+                }
+                last = c;
+            }
+            raw[y * stride + 1 + x] = index;
+        }
+    }
+
+    if (transparent >= 0) {
+        for (index = 0; index < colors; index++) {
+            if (palette[index] == (transparent & 0xffffff)) {
+                alpha = index;
+                break;
+            }
+        }
+    }
+
+    /* fixed huffman: at most 9 bits per byte */
+    out = malloc(sizeof(signature) + 25 + 12 + 768 + 12 + 256 +
+                 12 + 2 + (raw_len * 9) / 8 + 16 + 4 + 12);
+    if (!out) {
+        free(raw);
+        return -1;
+    }
+
+    memcpy(out, signature, sizeof(signature));
+    p = out + sizeof(signature);
+
+    /* IHDR: 8-bit palette, no interlace */
+    identicon_png_uint32(p + 8, w);
+    identicon_png_uint32(p + 12, h);
+    p[16] = 8;
+    p[17] = 3;
+    p[18] = 0;
+    p[19] = 0;
+    p[20] = 0;
+    p = identicon_png_chunk(p, "IHDR", 13);
+
+    /* PLTE */
+    for (index = 0; index < colors; index++) {
+        p[8 + index * 3] = gdTrueColorGetRed(palette[index]);
+        p[8 + index * 3 + 1] = gdTrueColorGetGreen(palette[index]);
+        p[8 + index * 3 + 2] = gdTrueColorGetBlue(palette[index]);
+    }
+    p = identicon_png_chunk(p, "PLTE", colors * 3);
+
+    /* tRNS: opaque up to the transparent entry */
+    if (alpha >= 0) {
+        memset(p + 8, 0xff, alpha);
+        p[8 + alpha] = 0;
+        p = identicon_png_chunk(p, "tRNS", alpha + 1);
+    }
+
+    /* IDAT: zlib header, deflate, adler32 */
+    bw.buf = p + 8;
+    bw.len = 0;
+    bw.bits = 0;
+    bw.nbits = 0;
+
+    bw.buf[bw.len++] = 0x78;
+    bw.buf[bw.len++] = 0x01;
+    identicon_deflate(&bw, raw, raw_len, stride);
+    identicon_png_uint32(bw.buf + bw.len, identicon_adler32(1, raw, raw_len));
+    bw.len += 4;
+
+    p = identicon_png_chunk(p, "IDAT", bw.len);
+
+    p = identicon_png_chunk(p, "IEND", 0);
+
+    free(raw);
+
+    /* released with gdFree() like gd output, which is free() */
+    *data = (char *)out;
+    *length = p - out;
+
+    return 0;
+}
+
+/* QOI (https://qoiformat.org/): 4 channels when transparent */
+static int
+identicon_qoi_encode(gdImagePtr img, int transparent,
+                     char **data, int *length)
+{
+    unsigned char index[64][4], px[4], prev[4], *out, *p;
+    int w = gdImageSX(img), h = gdImageSY(img);
+    int x, y, c, run = 0, hash;
+    signed char vr, vg, vb, vg_r, vg_b;
+
+    /* worst case: 5 bytes per pixel, and the length is an int */
+    if ((apr_uint64_t)w * h > (INT_MAX - 14 - 8) / 5) {
+        return -1;
+    }
+
+    out = malloc(14 + (size_t)w * h * 5 + 8);
+    if (!out) {
+        return -1;
+    }
+
+    memcpy(out, "qoif", 4);
+    identicon_png_uint32(out + 4, w);
+    identicon_png_uint32(out + 8, h);
+    out[12] = transparent >= 0 ? 4 : 3;
+    out[13] = 0;
+    p = out + 14;
+
+    memset(index, 0, sizeof(index));
+    prev[0] = prev[1] = prev[2] = 0;
+    prev[3] = 255;
+
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            c = gdImageTrueColorPixel(img, x, y) & 0xffffff;
+            px[0] = gdTrueColorGetRed(c);
+            px[1] = gdTrueColorGetGreen(c);
+            px[2] = gdTrueColorGetBlue(c);
+            px[3] = (transparent >= 0 &&
+                     c == (transparent & 0xffffff)) ? 0 : 255;
+
+            if (memcmp(px, prev, 4) == 0) {
+                run++;
+                if (run == 62) {
+                    *p++ = 0xc0 | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run > 0) {
+                *p++ = 0xc0 | (run - 1);
+                run = 0;
+            }
+
+            hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+
+            if (memcmp(index[hash], px, 4) == 0) {
+                *p++ = hash;
+            } else {
+                memcpy(index[hash], px, 4);
+
+                if (px[3] == prev[3]) {
+                    vr = px[0] - prev[0];
+                    vg = px[1] - prev[1];
+                    vb = px[2] - prev[2];
+                    vg_r = vr - vg;
+                    vg_b = vb - vg;
+
+                    if (vr > -3 && vr < 2 && vg > -3 && vg < 2 &&
+                        vb > -3 && vb < 2) {
+                        *p++ = 0x40 | (vr + 2) << 4 | (vg + 2) << 2 |
+                            (vb + 2);
+                    } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                               vg_b > -9 && vg_b < 8) {
+                        *p++ = 0x80 | (vg + 32);
+                        *p++ = (vg_r + 8) << 4 | (vg_b + 8);
+                    } else {
+                        *p++ = 0xfe;
+                        *p++ = px[0];
+                        *p++ = px[1];
+                        *p++ = px[2];
+                    }
+                } else {
+                    *p++ = 0xff;
+                    memcpy(p, px, 4);
+                    p += 4;
+                }
+            }
+
+            memcpy(prev, px, 4);
+        }
+    }
+
+    if (run > 0) {
+        *p++ = 0xc0 | (run - 1);
+    }
+
+    /* end marker */
+    memset(p, 0, 7);
+    p[7] = 1;
+    p += 8;
+
+    *data = (char *)out;
+    *length = p - out;
+
+    return 0;
+}
+
+/* raw RGBA: "RGBA", width and height (big endian), then the pixels */
+static int
+identicon_rgba_encode(gdImagePtr img, int transparent,
+                      char **data, int *length)
+{
+    unsigned char *out, *p;
+    int w = gdImageSX(img), h = gdImageSY(img);
+    int x, y, c;
+
+    if ((apr_uint64_t)w * h > (INT_MAX - 12) / 4) {
+        return -1;
+    }
+
+    out = malloc(12 + (size_t)w * h * 4);
+    if (!out) {
+        return -1;
+    }
+
+    memcpy(out, "RGBA", 4);
+    identicon_png_uint32(out + 4, w);
+    identicon_png_uint32(out + 8, h);
+    p = out + 12;
+
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            c = gdImageTrueColorPixel(img, x, y) & 0xffffff;
+            *p++ = gdTrueColorGetRed(c);
+            *p++ = gdTrueColorGetGreen(c);
+            *p++ = gdTrueColorGetBlue(c);
+            *p++ = (transparent >= 0 &&
+                    c == (transparent & 0xffffff)) ? 0 : 255;
+        }
+    }
+
+    *data = (char *)out;
+    *length = p - out;
+
+    return 0;
+}
+
+static int
+identicon_render_output(identicon_image_t *image, size_t size, int trans,
+                        identicon_encode_t *enc, char **data, int *length)
+{
+    gdImagePtr img, pal;
+    int ret;
+
+    img = identicon_image_resize(image, size, size,
+                                 enc->parallel > 0 && size >= enc->parallel);
+    if (img == NULL) {
+        return -1;
+    }
+
+    if (trans) {
+        identicon_image_transparent(image, img);
+    }
+
+    IDENTICON_PROBE2(stage__start, "encode", size);
+
+    if (enc->format == IDENTICON_FORMAT_QOI) {
+        ret = identicon_qoi_encode(img, trans ? image->background : -1,
+                                   data, length);
+    } else if (enc->format == IDENTICON_FORMAT_RGBA) {
+        ret = identicon_rgba_encode(img, trans ? image->background : -1,
+                                    data, length);
+    } else if (enc->direct > 0 && size <= enc->direct &&
+               identicon_png_direct(img, trans ? image->background : -1,
+                                    data, length) == 0) {
+        ret = 0;
+    } else {
+        if (enc->palette) {
+            pal = identicon_image_palette(image, img, trans);
+            if (pal) {
+                gdImageDestroy(img);
+                img = pal;
+            }
+        }
+
+        /* output */
+        *data = (char *)gdImagePngPtrEx(img, length, enc->level);
+
+        ret = *data ? 0 : -1;
+    }
+
+    gdImageDestroy(img);
+
+    IDENTICON_PROBE3(stage__done, "encode", size, ret);
+
+    return ret;
+}
+
+static int
+identicon_render(char *user, size_t size, int trans, identicon_encode_t *enc,
+                 char **data, int *length)
+{
+    identicon_image_t image;
+    int ret;
+
+    if (identicon_render_base(&image, user,
+                              enc->parallel > 0 && size >= enc->parallel) != 0) {
+        return -1;
+    }
+
+    ret = identicon_render_output(&image, size, trans, enc, data, length);
+
+    identicon_image_destroy(&image);
+
+    return ret;
+}
+
+static char *
+identicon_format_key(apr_pool_t *p, const char *user, size_t size, int trans,
+                     int format)
+{
+    char *key;
+
+    /* png keys are unchanged */
+    if (format == IDENTICON_FORMAT_PNG) {
+        key = apr_psprintf(p, "%s:%" APR_SIZE_T_FMT ":%d", user, size, trans);
+    } else {
+        key = apr_psprintf(p, "%s:%" APR_SIZE_T_FMT ":%d:%d",
+                           user, size, trans, format);
+    }
+
+    return ap_md5(p, (const unsigned char *)key);
+}
+
+static char *
+identicon_cache_key(apr_pool_t *p, const char *user, size_t size, int trans)
+{
+    return identicon_format_key(p, user, size, trans, IDENTICON_FORMAT_PNG);
+}
+
+static size_t
+identicon_size_snap(identicon_server_config_t *cfg, size_t size)
+{
+    int i;
+
+    /* also clamps sizes from the API and the warm list */
+    if (size > IDENTICON_MAX_SIZE) {
+        size = IDENTICON_MAX_SIZE;
+    }
+
+    if (!cfg->sizes || cfg->sizes->nelts == 0) {
+        return size;
+    }
+
+    /* smallest allowed size that is not smaller than the request */
+    for (i = 0; i < cfg->sizes->nelts; i++) {
+        if (APR_ARRAY_IDX(cfg->sizes, i, size_t) >= size) {
+            return APR_ARRAY_IDX(cfg->sizes, i, size_t);
+        }
+    }
+
+    return APR_ARRAY_IDX(cfg->sizes, cfg->sizes->nelts - 1, size_t);
+}
+
+/* in-flight renders of all children */
+static apr_uint32_t
+identicon_server_renders(void)
+{
+    apr_uint32_t i, renders = 0;
+
+    if (!identicon_stats) {
+        return 0;
+    }
+
+    for (i = 0; i < identicon_stats->slots; i++) {
+        renders += apr_atomic_read32(&identicon_render_slots[i].renders);
+    }
+
+    return renders;
+}
+
+/*
+ * Adaptive compression: spend CPU on entries that stay cached for long,
+ * save it when renders pile up (relative to IdenticonRenderLimit).
+ * The thresholds (half the limit, an hour of expiry) are unmeasured
+ * guesses.
+ */
+static void
+identicon_encode_options(identicon_server_config_t *cfg,
+                         identicon_encode_t *enc, int background)
+{
+    apr_uint32_t renders, limit;
+
+    enc->palette = cfg->png_palette;
+    enc->level = cfg->png_level;
+    enc->parallel = cfg->parallel_size;
+    enc->direct = cfg->png_direct;
+    enc->format = IDENTICON_FORMAT_PNG;
+
+    if (enc->level != IDENTICON_PNG_ADAPTIVE) {
+        return;
+    }
+
+    if (background) {
+        enc->level = IDENTICON_PNG_BEST;
+        return;
+    }
+
+    renders = apr_atomic_read32(&identicon_renders);
+    limit = cfg->render_limit;
+    if (identicon_stats && cfg->render_server_limit > 0) {
+        renders = identicon_server_renders();
+        limit = cfg->render_server_limit;
+    }
+
+    if (limit > 0 && renders * 2 >= limit) {
+        enc->level = IDENTICON_PNG_FAST;
+        return;
+    }
+
+#ifdef IDENTICON_HAVE_MEMCACHE
+    if (cfg->hosts &&
+        (cfg->expire == 0 || cfg->expire >= IDENTICON_PNG_LONG_EXPIRE)) {
+        enc->level = IDENTICON_PNG_BEST;
+        return;
+    }
+#endif
+
+    if (identicon_local ||
+        (cfg->socache_instance &&
+         cfg->socache_expire >= apr_time_from_sec(IDENTICON_PNG_LONG_EXPIRE))) {
+        enc->level = IDENTICON_PNG_BEST;
+    } else if (cfg->socache_instance) {
+        enc->level = IDENTICON_PNG_DEFAULT;
+    } else {
+        /* not cached: encoded for this response only */
+        enc->level = IDENTICON_PNG_FAST;
+    }
+}
+
+static void
+identicon_local_unlink(identicon_local_cache_t *cache, identicon_entry_t *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void
+identicon_local_push(identicon_local_cache_t *cache, identicon_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+
+    if (cache->head) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+
+    cache->head = entry;
+}
+
+static void
+identicon_local_free(identicon_entry_t *entry)
+{
+    free(entry->key);
+    free(entry->data);
+    free(entry);
+}
+
+static apr_status_t
+identicon_local_cleanup(void *parms)
+{
+    identicon_local_cache_t *cache = (identicon_local_cache_t *)parms;
+    identicon_entry_t *entry, *next;
+
+    for (entry = cache->head; entry; entry = next) {
+        next = entry->next;
+        identicon_local_free(entry);
+    }
+
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->count = 0;
+
+    if (identicon_local == cache) {
+        identicon_local = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+
+static identicon_local_cache_t *
+identicon_local_create(apr_pool_t *p, int max)
+{
+    identicon_local_cache_t *cache;
+
+    cache = apr_pcalloc(p, sizeof(identicon_local_cache_t));
+
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&cache->mutex,
+                                APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+        return NULL;
+    }
+#endif
+
+    cache->entries = apr_hash_make(p);
+    cache->max = max;
+
+    apr_pool_cleanup_register(p, (void *)cache, identicon_local_cleanup,
+                              apr_pool_cleanup_null);
+
+    return cache;
+}
+
+static char *
+identicon_local_get(identicon_local_cache_t *cache, apr_pool_t *p,
+                    const char *key, int *length)
+{
+    identicon_entry_t *entry;
+    char *data = NULL;
+
+    if (!cache) {
+        return NULL;
+    }
+
+    IDENTICON_PROBE2(cache__lookup, "local", key);
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+
+    entry = apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING);
+    if (entry) {
+        identicon_local_unlink(cache, entry);
+        identicon_local_push(cache, entry);
+
+        data = apr_pmemdup(p, entry->data, entry->length);
+        *length = entry->length;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+
+    IDENTICON_PROBE4(cache__result, "local", key, data != NULL,
+                     data ? *length : 0);
+
+    return data;
+}
+
+static void
+identicon_local_set(identicon_local_cache_t *cache, const char *key,
+                    const char *data, int length)
+{
+    identicon_entry_t *entry;
+
+    if (!cache || !data || length <= 0) {
+        return;
+    }
+
+    entry = calloc(1, sizeof(identicon_entry_t));
+    if (!entry) {
+        return;
+    }
+
+    entry->key = strdup(key);
+    entry->data = malloc(length);
+    if (!entry->key || !entry->data) {
+        identicon_local_free(entry);
+        return;
+    }
+
+    memcpy(entry->data, data, length);
+    entry->length = length;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+
+    if (apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING)) {
+        /* stored by a concurrent request */
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(cache->mutex);
+#endif
+        identicon_local_free(entry);
+        return;
+    }
+
+    apr_hash_set(cache->entries, entry->key, APR_HASH_KEY_STRING, entry);
+    identicon_local_push(cache, entry);
+    cache->count++;
+
+    /* evict least recently used */
+    while (cache->count > cache->max && cache->tail) {
+        identicon_entry_t *victim = cache->tail;
+
+        identicon_local_unlink(cache, victim);
+        apr_hash_set(cache->entries, victim->key, APR_HASH_KEY_STRING, NULL);
+        identicon_local_free(victim);
+        cache->count--;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+}
+
+static int
+identicon_local_exists(identicon_local_cache_t *cache, const char *key)
+{
+    int exists;
+
+    if (!cache) {
+        return 0;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+
+    exists = apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING) != NULL;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+
+    return exists;
+}
+
+/* one process at a time saves the snapshot: claimed by pid in shm */
+static int
+identicon_snapshot_claim(void)
+{
+    if (!identicon_stats) {
+        return 1;
+    }
+
+    return apr_atomic_cas32(&identicon_stats->snapshot_pid,
+                            (apr_uint32_t)getpid(), 0) == 0;
+}
+
+static void
+identicon_snapshot_release(void)
+{
+    if (identicon_stats) {
+        apr_atomic_cas32(&identicon_stats->snapshot_pid, 0,
+                         (apr_uint32_t)getpid());
+    }
+}
+
+/* entries in an existing snapshot file (0: none or unreadable) */
+static apr_uint32_t
+identicon_snapshot_count(const char *path, apr_pool_t *p)
+{
+    identicon_snapshot_header_t header;
+    apr_file_t *file;
+    apr_status_t rv;
+
+    if (apr_file_open(&file, path, APR_FOPEN_READ,
+                      APR_OS_DEFAULT, p) != APR_SUCCESS) {
+        return 0;
+    }
+
+    rv = apr_file_read_full(file, &header, sizeof(header), NULL);
+    apr_file_close(file);
+
+    if (rv != APR_SUCCESS ||
+        memcmp(header.magic, IDENTICON_SNAPSHOT_MAGIC,
+               sizeof(header.magic)) != 0 ||
+        header.version != IDENTICON_SNAPSHOT_VERSION) {
+        return 0;
+    }
+
+    return header.count;
+}
+
+/*
+ * Only the process holding the snapshot claim writes, and never over a
+ * snapshot with more entries (a recently forked child is mostly cold).
+ * Write to a temporary file and rename, so readers never see a partial
+ * one.
+ */
+static apr_status_t
+identicon_snapshot_save(void *parms)
+{
+    identicon_snapshot_t *snapshot = (identicon_snapshot_t *)parms;
+    identicon_local_cache_t *cache = snapshot->cache;
+    identicon_snapshot_header_t header;
+    identicon_snapshot_entry_t rec;
+    identicon_entry_t *entry;
+    apr_file_t *file;
+    apr_pool_t *p;
+    char *tmp;
+    apr_status_t rv;
+
+    if (apr_pool_create(&p, NULL) != APR_SUCCESS) {
+        identicon_snapshot_release();
+        return APR_SUCCESS;
+    }
+
+    if (cache->count < identicon_snapshot_count(snapshot->path, p)) {
+        _SDEBUG(snapshot->server, "cache snapshot: kept the fuller file");
+        identicon_snapshot_release();
+        apr_pool_destroy(p);
+        return APR_SUCCESS;
+    }
+
+    tmp = apr_pstrcat(p, snapshot->path, ".XXXXXX", NULL);
+
+    rv = apr_file_mktemp(&file, tmp,
+                         APR_FOPEN_CREATE | APR_FOPEN_WRITE |
+                         APR_FOPEN_EXCL | APR_FOPEN_BUFFERED, p);
+    if (rv != APR_SUCCESS) {
+        _SERR(snapshot->server, "Failed to create cache snapshot: %s", tmp);
+        identicon_snapshot_release();
+        apr_pool_destroy(p);
+        return APR_SUCCESS;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IDENTICON_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = IDENTICON_SNAPSHOT_VERSION;
+    header.count = cache->count;
+
+    rv = apr_file_write_full(file, &header, sizeof(header), NULL);
+
+    for (entry = cache->tail; entry && rv == APR_SUCCESS;
+         entry = entry->prev) {
+        rec.key_len = strlen(entry->key);
+        rec.data_len = entry->length;
+
+        rv = apr_file_write_full(file, &rec, sizeof(rec), NULL);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_write_full(file, entry->key, rec.key_len, NULL);
+        }
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_write_full(file, entry->data, rec.data_len, NULL);
+        }
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+
+    if (apr_file_close(file) != APR_SUCCESS || rv != APR_SUCCESS ||
+        apr_file_rename(tmp, snapshot->path, p) != APR_SUCCESS) {
+        _SERR(snapshot->server, "Failed to write cache snapshot: %s",
+              snapshot->path);
+        apr_file_remove(tmp, p);
+    }
+
+    identicon_snapshot_release();
+
+    apr_pool_destroy(p);
+
+    return APR_SUCCESS;
+}
+
+static void
+identicon_snapshot_load(identicon_local_cache_t *cache, server_rec *s,
+                        const char *path, apr_pool_t *p)
+{
+    identicon_snapshot_header_t header;
+    identicon_snapshot_entry_t rec;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    const char *base, *key;
+    apr_size_t offset;
+    apr_uint32_t i;
+    apr_pool_t *tmp;
+
+    if (apr_pool_create(&tmp, p) != APR_SUCCESS) {
+        return;
+    }
+
+    if (apr_file_open(&file, path, APR_FOPEN_READ,
+                      APR_OS_DEFAULT, tmp) != APR_SUCCESS) {
+        /* first start */
+        apr_pool_destroy(tmp);
+        return;
+    }
+
+    if (apr_file_info_get(&finfo, APR_FINFO_SIZE, file) != APR_SUCCESS ||
+        finfo.size < (apr_off_t)sizeof(header) ||
+        apr_mmap_create(&mm, file, 0, (apr_size_t)finfo.size,
+                        APR_MMAP_READ, tmp) != APR_SUCCESS) {
+        _SERR(s, "Failed to map cache snapshot: %s", path);
+        apr_pool_destroy(tmp);
+        return;
+    }
+
+    base = (const char *)mm->mm;
+
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, IDENTICON_SNAPSHOT_MAGIC,
+               sizeof(header.magic)) != 0 ||
+        header.version != IDENTICON_SNAPSHOT_VERSION) {
+        _SERR(s, "Ignored cache snapshot of another format: %s", path);
+        apr_pool_destroy(tmp);
+        return;
+    }
+
+    offset = sizeof(header);
+    for (i = 0; i < header.count; i++) {
+        if (mm->size - offset < sizeof(rec)) {
+            break;
+        }
+        memcpy(&rec, base + offset, sizeof(rec));
+        offset += sizeof(rec);
+
+        if (mm->size - offset < (apr_size_t)rec.key_len + rec.data_len ||
+            rec.key_len == 0 || rec.data_len == 0) {
+            break;
+        }
+
+        key = apr_pstrmemdup(tmp, base + offset, rec.key_len);
+        offset += rec.key_len;
+
+        /* least recently used first: the newest ends up at the head */
+        identicon_local_set(cache, key, base + offset, rec.data_len);
+        offset += rec.data_len;
+    }
+
+    if (i < header.count) {
+        _SERR(s, "Truncated cache snapshot: %s", path);
+    }
+
+    _SDEBUG(s, "cache snapshot: loaded %u entries", i);
+
+    apr_pool_destroy(tmp);
+}
+
+static int
+identicon_format_parse(const char *value, apr_size_t len)
+{
+    if (len == 3 && strncasecmp(value, "qoi", 3) == 0) {
+        return IDENTICON_FORMAT_QOI;
+    } else if (len == 4 && strncasecmp(value, "rgba", 4) == 0) {
+        return IDENTICON_FORMAT_RGBA;
+    }
+
+    return IDENTICON_FORMAT_PNG;
+}
+
+/*
+ * Scan the query string in place: values point into args and are not
+ * unescaped. The first occurrence of each parameter wins.
+ */
+static void
+identicon_args_parse(const char *args, identicon_args_t *a)
+{
+    const char *name, *value, *end;
+    apr_size_t name_len, value_len;
+
+    memset(a, 0, sizeof(identicon_args_t));
+
+    while (args && *args) {
+        name = args;
+        end = name;
+        while (*end && *end != '&' && *end != ';') {
+            end++;
+        }
+
+        value = memchr(name, '=', end - name);
+        if (value) {
+            name_len = value - name;
+            value++;
+            value_len = end - value;
+        } else {
+            name_len = end - name;
+            value = end;
+            value_len = 0;
+        }
+
+        if (name_len == 1) {
+            switch (name[0]) {
+                case 'u':
+                    if (!a->user) {
+                        a->user = value;
+                        a->user_len = value_len;
+                    }
+                    break;
+                case 's':
+                    if (a->size == 0) {
+                        while (value_len > 0 && apr_isdigit(*value) &&
+                               a->size < IDENTICON_MAX_SIZE) {
+                            a->size = (a->size * 10) + (*value - '0');
+                            value++;
+                            value_len--;
+                        }
+                    }
+                    break;
+                case 't':
+                    a->trans = 1;
+                    break;
+                case 'f':
+                    if (a->format == IDENTICON_FORMAT_PNG) {
+                        a->format = identicon_format_parse(value, value_len);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        args = *end ? end + 1 : end;
+    }
+}
+
+static const char *
+identicon_hint(request_rec *r, const char *name, const char *legacy)
+{
+    const char *value;
+
+    value = apr_table_get(r->headers_in, name);
+    if (!value) {
+        value = apr_table_get(r->headers_in, legacy);
+    }
+
+    return value;
+}
+
+/*
+ * Effective size in device pixels: Width is the display width of the
+ * image, else the css size ('s') times DPR, capped by the viewport.
+ */
+static size_t
+identicon_client_hints(request_rec *r, size_t size)
+{
+    const char *value;
+    double dpr = 0;
+    long width = 0, viewport = 0;
+
+    value = identicon_hint(r, "Sec-CH-DPR", "DPR");
+    if (value) {
+        dpr = strtod(value, NULL);
+        if (!(dpr > 0)) {
+            dpr = 0;
+        } else if (dpr > IDENTICON_MAX_DPR) {
+            dpr = IDENTICON_MAX_DPR;
+        }
+    }
+
+    value = identicon_hint(r, "Sec-CH-Width", "Width");
+    if (value) {
+        width = atol(value);
+    }
+
+    value = identicon_hint(r, "Sec-CH-Viewport-Width", "Viewport-Width");
+    if (value) {
+        viewport = atol(value);
+    }
+
+    if (width > 0) {
+        size = (size_t)width;
+    } else if (dpr > 0) {
+        size = (size_t)(size * dpr + 0.5);
+    }
+
+    if (viewport > 0) {
+        viewport = (long)(viewport * (dpr > 0 ? dpr : 1) + 0.5);
+        if (size > (size_t)viewport) {
+            size = (size_t)viewport;
+        }
+    }
+
+    if (size == 0) {
+        size = IDENTICON_DEFAULT_SIZE;
+    } else if (size > IDENTICON_MAX_SIZE) {
+        size = IDENTICON_MAX_SIZE;
+    }
+
+    _RDEBUG(r, "client hints: size=%" APR_SIZE_T_FMT, size);
+
+    return size;
+}
+
+static void
+identicon_request_params(request_rec *r, identicon_server_config_t *cfg,
+                         char **user, size_t *size, int *trans, int *format)
+{
+#ifdef IDENTICON_HAVE_APREQ2
+    char *param_s = NULL, *param_f = NULL;
+    apreq_handle_t *apreq;
+    apr_table_t *params;
+
+    *user = NULL;
+    *size = 0;
+    *trans = 0;
+    *format = IDENTICON_FORMAT_PNG;
+
+    apreq = apreq_handle_apache2(r);
+    params = apreq_params(apreq, r->pool);
+    if (params) {
+        *user = (char *)apreq_params_as_string(r->pool, params,
+                                               "u", APREQ_JOIN_AS_IS);
+        param_s = (char *)apreq_params_as_string(r->pool, params,
+                                                 "s", APREQ_JOIN_AS_IS);
+        param_f = (char *)apr_table_get(params, "f");
+        *trans = apr_table_get(params, "t") != NULL;
+        if (param_s) {
+            *size = (size_t)atol(param_s);
+        }
+        if (param_f) {
+            *format = identicon_format_parse(param_f, strlen(param_f));
+        }
+    }
+
+    if (!*user || strlen(*user) < 20) {
+        *user = IDENTICON_DEFAULT_HASH;
+    }
+#else
+    identicon_args_t args;
+
+    identicon_args_parse(r->args, &args);
+
+    *size = args.size;
+    *trans = args.trans;
+    *format = args.format;
+
+    if (args.user_len < 20) {
+        *user = IDENTICON_DEFAULT_HASH;
+    } else {
+        *user = apr_pstrmemdup(r->pool, args.user, args.user_len);
+        if (memchr(args.user, '%', args.user_len) ||
+            memchr(args.user, '+', args.user_len)) {
+            ap_unescape_urlencoded(*user);
+            if (strlen(*user) < 20) {
+                *user = IDENTICON_DEFAULT_HASH;
+            }
+        }
+    }
+#endif
+
+    if (*size == 0) {
+        *size = IDENTICON_DEFAULT_SIZE;
+    } else if (*size > IDENTICON_MAX_SIZE) {
+        *size = IDENTICON_MAX_SIZE;
+    }
+
+    if (cfg->client_hints) {
+        *size = identicon_client_hints(r, *size);
+    }
+
+    *size = identicon_size_snap(cfg, *size);
+}
+
+/* the key is an md5 hex string: each 8 digits index one row */
+static apr_uint32_t
+identicon_sketch_hash(const char *key, int row)
+{
+    apr_uint32_t hash = 0;
+    int i;
+
+    for (i = row * 8; i < row * 8 + 8 && key[i]; i++) {
+        hash = (hash << 4) | (apr_isdigit(key[i]) ? key[i] - '0' :
+                              (apr_tolower(key[i]) - 'a' + 10) & 0x0f);
+    }
+
+    return hash;
+}
+
+static void
+identicon_sketch_record(const char *key)
+{
+    apr_uint32_t i, end, total, count, width, samples;
+    int row;
+
+    if (!identicon_sketch) {
+        return;
+    }
+
+    width = identicon_sketch->width;
+
+    for (row = 0; row < IDENTICON_SKETCH_DEPTH; row++) {
+        apr_atomic_inc32(&identicon_sketch_counters[
+                             row * width +
+                             (identicon_sketch_hash(key, row) & (width - 1))]);
+    }
+
+    /* aging: reaching the sample size starts a halving round */
+    samples = apr_atomic_inc32(&identicon_sketch->samples) + 1;
+    if (samples == width * 10) {
+        apr_atomic_set32(&identicon_sketch->samples, 0);
+        apr_atomic_set32(&identicon_sketch->cursor, 0);
+    }
+
+    total = width * IDENTICON_SKETCH_DEPTH;
+    if (apr_atomic_read32(&identicon_sketch->cursor) >= total) {
+        return;
+    }
+
+    /* halve one slice; cas keeps increments made by other children */
+    i = apr_atomic_add32(&identicon_sketch->cursor,
+                         IDENTICON_SKETCH_AGE_SLICE);
+    end = i + IDENTICON_SKETCH_AGE_SLICE;
+    if (end > total) {
+        end = total;
+    }
+
+    for (; i < end; i++) {
+        do {
+            count = apr_atomic_read32(&identicon_sketch_counters[i]);
+        } while (count > 0 &&
+                 apr_atomic_cas32(&identicon_sketch_counters[i],
+                                  count / 2, count) != count);
+    }
+}
+
+static apr_uint32_t
+identicon_sketch_estimate(const char *key)
+{
+    apr_uint32_t width, count, min = 0;
+    int row;
+
+    width = identicon_sketch->width;
+
+    for (row = 0; row < IDENTICON_SKETCH_DEPTH; row++) {
+        count = apr_atomic_read32(&identicon_sketch_counters[
+                                      row * width +
+                                      (identicon_sketch_hash(key, row) &
+                                       (width - 1))]);
+        if (row == 0 || count < min) {
+            min = count;
+        }
+    }
+
+    return min;
+}
+
+/* the local cache is full and the key is not more frequent than the LRU */
+static int
+identicon_local_reject(identicon_local_cache_t *cache, apr_uint32_t freq)
+{
+    int reject = 0;
+
+    if (!cache) {
+        return 0;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+
+    if (cache->count >= cache->max && cache->tail &&
+        freq <= identicon_sketch_estimate(cache->tail->key)) {
+        reject = 1;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+
+    return reject;
+}
+
+/*
+ * Admission: the shared tiers take keys seen at least admission_min
+ * times, the local cache keys more frequent than its eviction victim.
+ */
+static int
+identicon_cache_admit(identicon_server_config_t *cfg, const char *key)
+{
+    apr_uint32_t freq;
+    int admit = IDENTICON_ADMIT_ALL;
+
+    if (!identicon_sketch) {
+        return admit;
+    }
+
+    freq = identicon_sketch_estimate(key);
+
+    if (freq < cfg->admission_min) {
+        admit &= ~IDENTICON_ADMIT_SHARED;
+    }
+
+    if (identicon_local_reject(identicon_local, freq)) {
+        admit &= ~IDENTICON_ADMIT_LOCAL;
+    }
+
+    if (identicon_stats) {
+        if (admit & IDENTICON_ADMIT_SHARED) {
+            apr_atomic_inc32(&identicon_stats->admitted);
+        } else {
+            apr_atomic_inc32(&identicon_stats->admission_rejected);
+        }
+        if (identicon_local && !(admit & IDENTICON_ADMIT_LOCAL)) {
+            apr_atomic_inc32(&identicon_stats->local_rejected);
+        }
+    }
+
+    return admit;
+}
+
+static identicon_request_t *
+identicon_request(request_rec *r, identicon_server_config_t *cfg)
+{
+    identicon_request_t *req;
+    identicon_dir_config_t *dcfg;
+
+    /* shared between the quick handler and the content handler */
+    req = ap_get_module_config(r->request_config, &identicon_module);
+    if (req) {
+        return req;
+    }
+
+    req = apr_pcalloc(r->pool, sizeof(identicon_request_t));
+
+    identicon_request_params(r, cfg, &req->user, &req->size, &req->trans,
+                             &req->format);
+
+    /* raw formats only where allowed */
+    if (req->format != IDENTICON_FORMAT_PNG) {
+        dcfg = ap_get_module_config(r->per_dir_config, &identicon_module);
+        if (!dcfg || dcfg->raw_formats != 1) {
+            req->format = IDENTICON_FORMAT_PNG;
+        }
+    }
+
+    if (cfg->client_hints) {
+        /* the size may depend on these, so caches must key on them */
+        apr_table_mergen(r->headers_out, "Vary", IDENTICON_CLIENT_HINTS);
+    }
+
+    req->key = identicon_format_key(r->pool, req->user, req->size, req->trans,
+                                    req->format);
+    req->etag = apr_pstrcat(r->pool, "W/\"", req->key, "\"", NULL);
+
+    identicon_sketch_record(req->key);
+
+    ap_set_module_config(r->request_config, &identicon_module, req);
+
+    return req;
+}
+
+static int
+identicon_not_modified(request_rec *r, identicon_request_t *req)
+{
+    const char *match;
+
+    /* output depends only on the cache key */
+    apr_table_setn(r->headers_out, "ETag", req->etag);
+
+    match = apr_table_get(r->headers_in, "If-None-Match");
+    if (!match) {
+        return 0;
+    }
+
+    if ((match[0] == '*' && match[1] == '\0') ||
+        ap_strstr_c(match, req->key)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+#if APR_HAS_THREADS
+static identicon_flight_t *
+identicon_flight_join(const char *key, int *leader)
+{
+    identicon_flight_t *flight;
+
+    *leader = 0;
+
+    if (!identicon_flights) {
+        return NULL;
+    }
+
+    apr_thread_mutex_lock(identicon_flight_mutex);
+
+    flight = apr_hash_get(identicon_flights, key, APR_HASH_KEY_STRING);
+    if (flight) {
+        flight->refs++;
+    } else {
+        flight = calloc(1, sizeof(identicon_flight_t));
+        if (flight) {
+            flight->key = strdup(key);
+            if (flight->key) {
+                flight->refs = 1;
+                apr_hash_set(identicon_flights, flight->key,
+                             APR_HASH_KEY_STRING, flight);
+                *leader = 1;
+            } else {
+                free(flight);
+                flight = NULL;
+            }
+        }
+    }
+
+    apr_thread_mutex_unlock(identicon_flight_mutex);
+
+    return flight;
+}
+
+static void
+identicon_flight_finish(identicon_flight_t *flight, char *data, int length)
+{
+    apr_thread_mutex_lock(identicon_flight_mutex);
+
+    /* late arrivals start a new flight (and will most likely hit cache) */
+    apr_hash_set(identicon_flights, flight->key, APR_HASH_KEY_STRING, NULL);
+
+    if (data && flight->refs > 1) {
+        flight->data = malloc(length);
+        if (flight->data) {
+            memcpy(flight->data, data, length);
+            flight->length = length;
+        }
+    }
+
+    flight->done = 1;
+
+    apr_thread_cond_broadcast(identicon_flight_cond);
+    apr_thread_mutex_unlock(identicon_flight_mutex);
+}
+
+static char *
+identicon_flight_wait(identicon_flight_t *flight, apr_pool_t *p,
+                      apr_interval_time_t timeout, int *length)
+{
+    char *data = NULL;
+    apr_time_t deadline = apr_time_now() + timeout;
+    apr_interval_time_t remaining;
+
+    apr_thread_mutex_lock(identicon_flight_mutex);
+
+    while (!flight->done) {
+        remaining = deadline - apr_time_now();
+        if (remaining <= 0) {
+            break;
+        }
+        apr_thread_cond_timedwait(identicon_flight_cond,
+                                  identicon_flight_mutex, remaining);
+    }
+
+    if (flight->done && flight->data) {
+        data = apr_pmemdup(p, flight->data, flight->length);
+        *length = flight->length;
+    }
+
+    apr_thread_mutex_unlock(identicon_flight_mutex);
+
+    return data;
+}
+
+static void
+identicon_flight_leave(identicon_flight_t *flight)
+{
+    int refs;
+
+    apr_thread_mutex_lock(identicon_flight_mutex);
+    refs = --flight->refs;
+    if (refs == 0 && !flight->done) {
+        apr_hash_set(identicon_flights, flight->key, APR_HASH_KEY_STRING, NULL);
+    }
+    apr_thread_mutex_unlock(identicon_flight_mutex);
+
+    if (refs == 0) {
+        if (flight->data) {
+            free(flight->data);
+        }
+        free(flight->key);
+        free(flight);
+    }
+}
+#endif
+
+#ifdef IDENTICON_HAVE_MEMCACHE
+static apr_status_t
+memcache_cleanup(void *parms)
+{
+    identicon_server_config_t *cfg = (identicon_server_config_t *)parms;
+
+    if (!cfg) {
+        return APR_SUCCESS;
+    }
+
+    /* memcached cleanup: the handles of the pool, then the master */
+    if (cfg->memc_pool) {
+        memcached_pool_destroy(cfg->memc_pool);
+        cfg->memc_pool = NULL;
+    }
+
+    if (cfg->memc) {
+        memcached_free(cfg->memc);
+        cfg->memc = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+
+static int
+memcache_behavior(identicon_server_config_t *cfg, struct memcached_st *memc)
+{
+    /* replication is only supported by the binary protocol */
+    if (cfg->binary || cfg->replicas > 0) {
+        if (memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL,
+                                   1) != MEMCACHED_SUCCESS) {
+            return -1;
+        }
+    }
+
+    /* consistent hashing: adding a node remaps about 1/n of the keys */
+    if (cfg->ketama) {
+        if (memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_KETAMA_WEIGHTED,
+                                   1) != MEMCACHED_SUCCESS) {
+            return -1;
+        }
+    }
+
+    if (cfg->replicas > 0) {
+        if (memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS,
+                                   cfg->replicas) != MEMCACHED_SUCCESS) {
+            return -1;
+        }
+    }
+
+    /* eject a node after failure_limit errors, retry it after retry sec */
+    if (cfg->failure_limit > 0) {
+        if (memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_REMOVE_FAILED_SERVERS,
+                                   1) != MEMCACHED_SUCCESS ||
+            memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT,
+                                   cfg->failure_limit) != MEMCACHED_SUCCESS ||
+            memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_RETRY_TIMEOUT,
+                                   cfg->retry) != MEMCACHED_SUCCESS) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+typedef struct {
+    memcached_pool_st *pool;
+    struct memcached_st *memc;
+} memcache_handle_t;
+
+static apr_status_t
+memcache_handle_release(void *parms)
+{
+    memcache_handle_t *handle = (memcache_handle_t *)parms;
+
+    memcached_pool_push(handle->pool, handle->memc);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * libmemcached handles are not thread-safe: each request takes one from
+ * the child's pool and gives it back with the request pool.
+ */
+struct memcached_st *
+memcache_init(request_rec *r, time_t *expire)
+{
+    identicon_server_config_t *cfg;
+    memcache_handle_t *handle = NULL;
+    struct memcached_st *memc;
+    memcached_return rc;
+
+    cfg = ap_get_module_config(r->server->module_config, &identicon_module);
+
+    if (!cfg->hosts || !cfg->memc_pool) {
+        return NULL;
+    }
+
+    *expire = cfg->expire;
+
+    apr_pool_userdata_get((void **)&handle, IDENTICON_MEMCACHE_HANDLE,
+                          r->pool);
+    if (handle) {
+        return handle->memc;
+    }
+
+    memc = memcached_pool_pop(cfg->memc_pool, true, &rc);
+    if (!memc) {
+        _RDEBUG(r, "no memcache handle available");
+        return NULL;
+    }
+
+    handle = apr_palloc(r->pool, sizeof(memcache_handle_t));
+    handle->pool = cfg->memc_pool;
+    handle->memc = memc;
+
+    apr_pool_userdata_setn(handle, IDENTICON_MEMCACHE_HANDLE,
+                           apr_pool_cleanup_null, r->pool);
+    apr_pool_cleanup_register(r->pool, handle, memcache_handle_release,
+                              apr_pool_cleanup_null);
+
+    return memc;
+}
+
+static char *
+memcache_get(struct memcached_st *memc, const char *key, int *length)
+{
+    char *ret = NULL;
+    size_t ret_len;
+    memcached_return rc;
+
+    if (!memc || !key) {
+        return NULL;
+    }
+
+    ret = memcached_get(memc, key, strlen(key), &ret_len, (uint16_t)0, &rc);
+    if (rc != MEMCACHED_SUCCESS) {
+        if (ret) {
+            free(ret);
+        }
+        *length = 0;
+        return NULL;
+    }
+
+    *length = (int)ret_len;
+
+    return ret;
+}
+
+static apr_status_t
+memcache_set(struct memcached_st *memc, const char *key,
+             char *data, int length, time_t expire)
+{
+    if (!memc || !key) {
+        return APR_EGENERAL;
+    }
+
+    if (memcached_set(memc, key, strlen(key), data, length,
+                      expire, (uint16_t)0) != MEMCACHED_SUCCESS) {
+        return APR_EGENERAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Render lease shared by all children: memcached_add only succeeds for
+ * the first caller, so one process renders while the others poll.
+ */
+static int
+memcache_lease(struct memcached_st *memc, apr_pool_t *p, const char *key,
+               apr_interval_time_t timeout)
+{
+    char *lease;
+    time_t ttl;
+    memcached_return rc;
+
+    if (!memc || !key) {
+        return 1;
+    }
+
+    lease = apr_pstrcat(p, IDENTICON_LEASE_PREFIX, key, NULL);
+    ttl = (time_t)apr_time_sec(timeout) + 1;
+
+    rc = memcached_add(memc, lease, strlen(lease), "1", 1, ttl, (uint16_t)0);
+    if (rc == MEMCACHED_NOTSTORED || rc == MEMCACHED_DATA_EXISTS) {
+        return 0;
+    }
+
+    /* lease acquired, or memcached unusable: render locally */
+    return 1;
+}
+
+static void
+memcache_release(struct memcached_st *memc, apr_pool_t *p, const char *key)
+{
+    char *lease;
+
+    if (!memc || !key) {
+        return;
+    }
+
+    lease = apr_pstrcat(p, IDENTICON_LEASE_PREFIX, key, NULL);
+
+    memcached_delete(memc, lease, strlen(lease), (time_t)0);
+}
+
+/*
+ * Poll for the leader's image until its lease is released. A lease
+ * released without an image (render failed, or not admitted to the
+ * shared tiers) ends the wait at once.
+ */
+static char *
+memcache_wait(struct memcached_st *memc, apr_pool_t *p, const char *key,
+              apr_interval_time_t timeout, int *length)
+{
+    char *ret, *lease, *data = NULL;
+    apr_time_t deadline = apr_time_now() + timeout;
+    int held, lease_len;
+
+    lease = apr_pstrcat(p, IDENTICON_LEASE_PREFIX, key, NULL);
+
+    do {
+        apr_sleep(apr_time_from_msec(IDENTICON_COALESCE_POLL));
+
+        /* check the lease first: the leader stores, then releases */
+        ret = memcache_get(memc, lease, &lease_len);
+        held = ret != NULL;
+        if (ret) {
+            free(ret);
+        }
+
+        ret = memcache_get(memc, key, length);
+        if (ret) {
+            data = apr_pmemdup(p, ret, *length);
+            free(ret);
+            break;
+        }
+    } while (held && apr_time_now() < deadline);
+
+    return data;
+}
+
+static struct memcached_st *
+memcache_connect(identicon_server_config_t *cfg)
+{
+    struct memcached_st *memc;
+    struct memcached_server_st *servers;
+
+    memc = memcached_create(NULL);
+    if (!memc) {
+        return NULL;
+    }
+
+    if (memcache_behavior(cfg, memc) != 0) {
+        memcached_free(memc);
+        return NULL;
+    }
+
+    servers = memcached_servers_parse(cfg->hosts);
+    if (!servers) {
+        memcached_free(memc);
+        return NULL;
+    }
+
+    if (memcached_server_push(memc, servers) != MEMCACHED_SUCCESS) {
+        memcached_server_list_free(servers);
+        memcached_free(memc);
+        return NULL;
+    }
+
+    memcached_server_list_free(servers);
+
+    return memc;
+}
+
+/* child: one handle per worker thread, cloned from a master */
+static void
+memcache_child_init(apr_pool_t *p, server_rec *s)
+{
+    identicon_server_config_t *cfg;
+    server_rec *vs;
+    int threads = 1;
+
+    ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads);
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    for (vs = s; vs; vs = vs->next) {
+        cfg = ap_get_module_config(vs->module_config, &identicon_module);
+        if (!cfg->hosts || cfg->memc_pool) {
+            continue;
+        }
+
+        cfg->memc = memcache_connect(cfg);
+        if (!cfg->memc) {
+            _SERR(vs, "Failed to set up memcache: %s", cfg->hosts);
+            continue;
+        }
+
+        cfg->memc_pool = memcached_pool_create(cfg->memc, 1, threads);
+        if (!cfg->memc_pool) {
+            _SERR(vs, "Failed to create memcache pool");
+            memcached_free(cfg->memc);
+            cfg->memc = NULL;
+            continue;
+        }
+
+        apr_pool_cleanup_register(p, (void *)cfg, memcache_cleanup,
+                                  apr_pool_cleanup_null);
+    }
+}
+#endif
+
+static void
+identicon_warm_default(identicon_server_config_t *cfg, apr_pool_t *p)
+{
+    identicon_warm_t *warm;
+    int i;
+
+    /* malformed or short hashes fall back to the default image */
+    if (!cfg->sizes || cfg->sizes->nelts == 0) {
+        warm = (identicon_warm_t *)apr_array_push(cfg->warm);
+        warm->user = IDENTICON_DEFAULT_HASH;
+        warm->size = IDENTICON_DEFAULT_SIZE;
+        return;
+    }
+
+    for (i = 0; i < cfg->sizes->nelts; i++) {
+        warm = (identicon_warm_t *)apr_array_push(cfg->warm);
+        warm->user = IDENTICON_DEFAULT_HASH;
+        warm->size = APR_ARRAY_IDX(cfg->sizes, i, size_t);
+    }
+}
+
+static apr_status_t
+identicon_warm_load(identicon_server_config_t *cfg, apr_pool_t *p,
+                    server_rec *s)
+{
+    ap_configfile_t *file;
+    char line[MAX_STRING_LEN];
+    const char *ptr;
+    char *user, *arg;
+    identicon_warm_t *warm;
+    apr_status_t rv;
+    size_t size;
+    int sized;
+
+    cfg->warm = apr_array_make(p, 16, sizeof(identicon_warm_t));
+
+    identicon_warm_default(cfg, p);
+
+    if (!cfg->warm_list) {
+        return APR_SUCCESS;
+    }
+
+    rv = ap_pcfg_openfile(&file, p, cfg->warm_list);
+    if (rv != APR_SUCCESS) {
+        _SERR(s, "Failed to open warm list: %s", cfg->warm_list);
+        return rv;
+    }
+
+    /* hash [size ...] */
+    while (!ap_cfg_getline(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+
+        ptr = line;
+        user = ap_getword_conf(p, &ptr);
+        if (strlen(user) < 20) {
+            continue;
+        }
+
+        sized = 0;
+        while (*(arg = ap_getword_conf(p, &ptr)) != '\0') {
+            size = (size_t)atol(arg);
+            if (size == 0) {
+                continue;
+            }
+            warm = (identicon_warm_t *)apr_array_push(cfg->warm);
+            warm->user = user;
+            warm->size = identicon_size_snap(cfg, size);
+            sized = 1;
+        }
+
+        if (!sized) {
+            warm = (identicon_warm_t *)apr_array_push(cfg->warm);
+            warm->user = user;
+            warm->size = identicon_size_snap(cfg, IDENTICON_DEFAULT_SIZE);
+        }
+    }
+
+    ap_cfg_closefile(file);
+
+    _SDEBUG(s, "warm list: %d entries", cfg->warm->nelts);
+
+    return APR_SUCCESS;
+}
+
+#ifdef IDENTICON_HAVE_MEMCACHE
+static void
+identicon_warm_memcache(identicon_server_config_t *cfg, apr_pool_t *p)
+{
+    struct memcached_st *memc;
+    identicon_warm_t *warm;
+    identicon_encode_t enc;
+    char *key, *data;
+    int i, length;
+
+    if (!cfg->hosts) {
+        return;
+    }
+
+    memc = memcache_connect(cfg);
+    if (!memc) {
+        return;
+    }
+
+    identicon_encode_options(cfg, &enc, 1);
+
+    for (i = 0; i < cfg->warm->nelts; i++) {
+        warm = &APR_ARRAY_IDX(cfg->warm, i, identicon_warm_t);
+        key = identicon_cache_key(p, warm->user, warm->size, 0);
+
+        data = memcache_get(memc, key, &length);
+        if (data) {
+            free(data);
+            continue;
+        }
+
+        if (identicon_render(warm->user, warm->size, 0, &enc,
+                             &data, &length) == 0) {
+            memcache_set(memc, key, data, length, cfg->expire);
+            gdFree(data);
+        }
+    }
+
+    memcached_free(memc);
+}
+#endif
+
+/* shared object cache: warm once in the parent, like memcached */
+static void
+identicon_warm_socache(identicon_server_config_t *cfg, apr_pool_t *p,
+                       server_rec *s)
+{
+    identicon_warm_t *warm;
+    identicon_encode_t enc;
+    unsigned char *buf;
+    unsigned int buf_len;
+    char *key, *data;
+    int i, length;
+    apr_status_t rv;
+
+    if (!cfg->socache_instance) {
+        return;
+    }
+
+    identicon_encode_options(cfg, &enc, 1);
+
+    buf = apr_palloc(p, IDENTICON_SOCACHE_MAX_SIZE);
+
+    for (i = 0; i < cfg->warm->nelts; i++) {
+        warm = &APR_ARRAY_IDX(cfg->warm, i, identicon_warm_t);
+        key = identicon_cache_key(p, warm->user, warm->size, 0);
+
+        if (identicon_socache_mutex) {
+            apr_global_mutex_lock(identicon_socache_mutex);
+        }
+
+        buf_len = IDENTICON_SOCACHE_MAX_SIZE;
+        rv = cfg->socache->retrieve(cfg->socache_instance, s,
+                                    (const unsigned char *)key, strlen(key),
+                                    buf, &buf_len, p);
+
+        if (identicon_socache_mutex) {
+            apr_global_mutex_unlock(identicon_socache_mutex);
+        }
+
+        if (rv == APR_SUCCESS) {
+            continue;
+        }
+
+        if (identicon_render(warm->user, warm->size, 0, &enc,
+                             &data, &length) != 0) {
+            continue;
+        }
+
+        if (length <= IDENTICON_SOCACHE_MAX_SIZE) {
+            if (identicon_socache_mutex) {
+                apr_global_mutex_lock(identicon_socache_mutex);
+            }
+
+            cfg->socache->store(cfg->socache_instance, s,
+                                (const unsigned char *)key, strlen(key),
+                                apr_time_now() + cfg->socache_expire,
+                                (unsigned char *)data, length, p);
+
+            if (identicon_socache_mutex) {
+                apr_global_mutex_unlock(identicon_socache_mutex);
+            }
+        }
+
+        gdFree(data);
+    }
+}
+
+static void
+identicon_warm_local(identicon_server_config_t *cfg, apr_pool_t *p)
+{
+    identicon_warm_t *warm;
+    identicon_encode_t enc;
+    char *key, *data;
+    int i, length;
+
+    identicon_encode_options(cfg, &enc, 1);
+
+    for (i = 0; i < cfg->warm->nelts; i++) {
+#if APR_HAS_THREADS
+        if (identicon_warm_stop) {
+            break;
+        }
+#endif
+
+        warm = &APR_ARRAY_IDX(cfg->warm, i, identicon_warm_t);
+        key = identicon_cache_key(p, warm->user, warm->size, 0);
+
+        /* restored from the snapshot */
+        if (identicon_local_exists(identicon_local, key)) {
+            continue;
+        }
+
+        if (identicon_render(warm->user, warm->size, 0, &enc,
+                             &data, &length) == 0) {
+            identicon_local_set(identicon_local, key, data, length);
+            gdFree(data);
+        }
+    }
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC
+identicon_warm_thread_main(apr_thread_t *thd, void *parms)
+{
+    identicon_server_config_t *cfg = (identicon_server_config_t *)parms;
+    apr_pool_t *p;
+
+    if (apr_pool_create(&p, NULL) == APR_SUCCESS) {
+        identicon_warm_local(cfg, p);
+        apr_pool_destroy(p);
+    }
+
+    apr_thread_exit(thd, APR_SUCCESS);
+
+    return NULL;
+}
+
+static apr_status_t
+identicon_warm_cleanup(void *parms)
+{
+    apr_status_t rv;
+
+    if (identicon_warm_thread) {
+        identicon_warm_stop = 1;
+        apr_thread_join(&rv, identicon_warm_thread);
+        identicon_warm_thread = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+#endif
+
+/* per-process state: request coalescing and the tile thread pool */
+static int
+identicon_process_init(apr_pool_t *p, server_rec *s,
+                       identicon_server_config_t *cfg)
+{
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&identicon_flight_mutex,
+                                APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS ||
+        apr_thread_cond_create(&identicon_flight_cond, p) != APR_SUCCESS) {
+        _SERR(s, "Failed to create coalesce lock");
+        return -1;
+    }
+
+    identicon_flights = apr_hash_make(p);
+
+    if (cfg->render_threads > 0) {
+        if (apr_thread_mutex_create(&identicon_task_mutex,
+                                    APR_THREAD_MUTEX_DEFAULT,
+                                    p) != APR_SUCCESS ||
+            apr_thread_cond_create(&identicon_task_cond, p) != APR_SUCCESS ||
+            apr_thread_pool_create(&identicon_thread_pool, 0,
+                                   cfg->render_threads, p) != APR_SUCCESS) {
+            _SERR(s, "Failed to create render thread pool");
+            identicon_thread_pool = NULL;
+        } else {
+            identicon_thread_bands = cfg->render_threads + 1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/* local cache with its snapshot, warmed in the background */
+static void
+identicon_local_init(apr_pool_t *p, server_rec *s,
+                     identicon_server_config_t *cfg, int max)
+{
+    identicon_local = identicon_local_create(p, max);
+    if (!identicon_local) {
+        _SERR(s, "Failed to create local cache");
+        return;
+    }
+
+    if (cfg->snapshot) {
+        identicon_snapshot_t *snapshot;
+
+        identicon_snapshot_load(identicon_local, s, cfg->snapshot, p);
+
+        /* runs before the cache is freed (cleanups run in reverse) */
+        if (identicon_snapshot_claim()) {
+            snapshot = apr_pcalloc(p, sizeof(identicon_snapshot_t));
+            snapshot->cache = identicon_local;
+            snapshot->server = s;
+            snapshot->path = cfg->snapshot;
+
+            apr_pool_cleanup_register(p, snapshot, identicon_snapshot_save,
+                                      apr_pool_cleanup_null);
+        }
+    }
+
+    if (!cfg->warm) {
+        return;
+    }
+
+#if APR_HAS_THREADS
+    identicon_warm_stop = 0;
+    if (apr_thread_create(&identicon_warm_thread, NULL,
+                          identicon_warm_thread_main, cfg, p) == APR_SUCCESS) {
+        apr_pool_cleanup_register(p, NULL, identicon_warm_cleanup,
+                                  apr_pool_cleanup_null);
+    } else {
+        identicon_warm_thread = NULL;
+        _SERR(s, "Failed to create warm thread");
+    }
+#else
+    identicon_warm_local(cfg, p);
+#endif
+}
+
+static int
+identicon_sock_write(int fd, const void *buf, size_t len)
+{
+    const char *ptr = (const char *)buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, ptr, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int
+identicon_sock_read(int fd, void *buf, size_t len)
+{
+    char *ptr = (char *)buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, ptr, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (n == 0) {
+            return -1;
+        }
+        ptr += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static char *
+identicon_daemon_read(int fd, apr_pool_t *p, identicon_daemon_request_t *req)
+{
+    char *user;
+
+    if (identicon_sock_read(fd, req, sizeof(*req)) != 0 ||
+        req->version != IDENTICON_DAEMON_VERSION ||
+        req->user_len == 0 || req->user_len > IDENTICON_DAEMON_USER_MAX ||
+        req->size == 0 || req->size > IDENTICON_MAX_SIZE ||
+        req->format > IDENTICON_FORMAT_RGBA) {
+        return NULL;
+    }
+
+    user = apr_palloc(p, req->user_len + 1);
+    if (identicon_sock_read(fd, user, req->user_len) != 0) {
+        return NULL;
+    }
+    user[req->user_len] = '\0';
+
+    /* rendering reads 18 hash characters: same rule as the handler */
+    if (strlen(user) < 20) {
+        return IDENTICON_DEFAULT_HASH;
+    }
+
+    return user;
+}
+
+/* daemon: answer one request from the daemon cache or render it */
+static void
+identicon_daemon_serve(identicon_server_config_t *cfg, int fd)
+{
+    identicon_daemon_request_t req;
+    identicon_daemon_response_t res;
+    identicon_encode_t enc;
+    apr_pool_t *p;
+    char *user, *key, *data = NULL, *rendered = NULL;
+    int length = 0;
+#if APR_HAS_THREADS
+    identicon_flight_t *flight = NULL;
+    int leader = 0;
+#endif
+
+    if (apr_pool_create(&p, NULL) != APR_SUCCESS) {
+        close(fd);
+        return;
+    }
+
+    user = identicon_daemon_read(fd, p, &req);
+    if (!user) {
+        close(fd);
+        apr_pool_destroy(p);
+        return;
+    }
+
+    key = identicon_format_key(p, user, req.size, req.trans, req.format);
+
+    data = identicon_local_get(identicon_local, p, key, &length);
+
+#if APR_HAS_THREADS
+    /* concurrent requests for the same key share one render */
+    if (!data && cfg->coalesce) {
+        flight = identicon_flight_join(key, &leader);
+        if (flight && !leader) {
+            data = identicon_flight_wait(flight, p, cfg->coalesce_wait,
+                                         &length);
+            identicon_flight_leave(flight);
+            flight = NULL;
+        }
+    }
+#endif
+
+    if (!data) {
+        enc.level = req.level;
+        enc.palette = req.palette;
+        enc.parallel = cfg->parallel_size;
+        enc.direct = cfg->png_direct;
+        enc.format = req.format;
+
+        if (identicon_render(user, req.size, req.trans, &enc,
+                             &rendered, &length) == 0) {
+            data = rendered;
+            identicon_local_set(identicon_local, key, data, length);
+        }
+    }
+
+#if APR_HAS_THREADS
+    if (flight) {
+        identicon_flight_finish(flight, data, length);
+        identicon_flight_leave(flight);
+    }
+#endif
+
+    res.status = data ? 0 : -1;
+    res.length = data ? length : 0;
+
+    if (identicon_sock_write(fd, &res, sizeof(res)) == 0 && data) {
+        identicon_sock_write(fd, data, length);
+    }
+
+    if (rendered) {
+        gdFree(rendered);
+    }
+
+    close(fd);
+    apr_pool_destroy(p);
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC
+identicon_daemon_conn_main(apr_thread_t *thd, void *parms)
+{
+    identicon_daemon_conn_t *conn = (identicon_daemon_conn_t *)parms;
+
+    identicon_daemon_serve(conn->cfg, conn->fd);
+    free(conn);
+
+    return NULL;
+}
+#endif
+
+static void
+identicon_daemon_signal(int signo)
+{
+    identicon_daemon_exit = 1;
+}
+
+static int
+identicon_daemon_main(apr_pool_t *p, server_rec *s)
+{
+    identicon_server_config_t *cfg;
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+    int sd, fd;
+#if APR_HAS_THREADS
+    apr_thread_pool_t *threads = NULL;
+    identicon_daemon_conn_t *conn;
+#endif
+
+    cfg = ap_get_module_config(s->module_config, &identicon_module);
+
+    apr_signal(SIGCHLD, SIG_IGN);
+    apr_signal(SIGHUP, identicon_daemon_signal);
+    apr_signal(SIGTERM, identicon_daemon_signal);
+    apr_signal(AP_SIG_GRACEFUL, identicon_daemon_signal);
+
+    ap_close_listeners();
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    apr_cpystrn(addr.sun_path, identicon_daemon_sock, sizeof(addr.sun_path));
+
+    sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd < 0) {
+        _SERR(s, "Failed to create daemon socket");
+        return -1;
+    }
+
+    unlink(identicon_daemon_sock);
+
+    if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sd, IDENTICON_DAEMON_BACKLOG) < 0) {
+        _SERR(s, "Failed to listen on daemon socket: %s",
+              identicon_daemon_sock);
+        close(sd);
+        return -1;
+    }
+
+    /* children connect as the httpd user */
+    if (!geteuid() &&
+        chown(identicon_daemon_sock, ap_unixd_config.user_id, -1) < 0) {
+        _SERR(s, "Failed to chown daemon socket: %s", identicon_daemon_sock);
+        close(sd);
+        return -1;
+    }
+
+    if (ap_run_drop_privileges(p, s)) {
+        close(sd);
+        return -1;
+    }
+
+    if (identicon_process_init(p, s, cfg) != 0) {
+        close(sd);
+        return -1;
+    }
+
+    /* the daemon owns the cache */
+    identicon_local_init(p, s, cfg, cfg->local_cache > 0 ?
+                         cfg->local_cache : IDENTICON_DEFAULT_DAEMON_CACHE);
+
+#if APR_HAS_THREADS
+    if (apr_thread_pool_create(&threads, 0, cfg->daemon_threads,
+                               p) != APR_SUCCESS) {
+        _SERR(s, "Failed to create daemon threads");
+        threads = NULL;
+    }
+#endif
+
+    pfd.fd = sd;
+    pfd.events = POLLIN;
+
+    while (!identicon_daemon_exit) {
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+
+        fd = accept(sd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+#if APR_HAS_THREADS
+        if (threads) {
+            conn = malloc(sizeof(identicon_daemon_conn_t));
+            if (conn) {
+                conn->cfg = cfg;
+                conn->fd = fd;
+                if (apr_thread_pool_push(threads, identicon_daemon_conn_main,
+                                         conn,
+                                         APR_THREAD_TASK_PRIORITY_NORMAL,
+                                         NULL) == APR_SUCCESS) {
+                    continue;
+                }
+                free(conn);
+            }
+        }
+#endif
+
+        identicon_daemon_serve(cfg, fd);
+    }
+
+    close(sd);
+    unlink(identicon_daemon_sock);
+
+    return 0;
+}
+
+static int identicon_daemon_start(apr_pool_t *p, server_rec *s);
+
+#if APR_HAS_OTHER_CHILD
+/* restart the daemon when it dies, as mod_cgid does */
+static void
+identicon_daemon_maint(int reason, void *data, apr_wait_t status)
+{
+    apr_proc_t *proc = (apr_proc_t *)data;
+    int mpm_state, stopping;
+
+    switch (reason) {
+        case APR_OC_REASON_DEATH:
+        case APR_OC_REASON_LOST:
+            apr_proc_other_child_unregister(data);
+
+            if (identicon_stats) {
+                apr_atomic_cas32(&identicon_stats->snapshot_pid, 0,
+                                 (apr_uint32_t)proc->pid);
+            }
+
+            stopping = 1;
+            if (ap_mpm_query(AP_MPMQ_MPM_STATE, &mpm_state) == APR_SUCCESS &&
+                mpm_state != AP_MPMQ_STOPPING) {
+                stopping = 0;
+            }
+
+            if (stopping) {
+                break;
+            }
+
+            /* a daemon that keeps dying on startup is not respawned */
+            if (apr_time_now() - identicon_daemon_started <
+                apr_time_from_sec(IDENTICON_DAEMON_MIN_UPTIME)) {
+                identicon_daemon_failures++;
+            } else {
+                identicon_daemon_failures = 0;
+            }
+
+            if (identicon_daemon_failures >= IDENTICON_DAEMON_MAX_FAILURES) {
+                _SERR(identicon_daemon_server,
+                      "Render daemon died %d times within %d seconds of "
+                      "starting, not restarting until the next restart",
+                      identicon_daemon_failures, IDENTICON_DAEMON_MIN_UPTIME);
+                break;
+            }
+
+            _SERR(identicon_daemon_server, "Render daemon died, restarting");
+            identicon_daemon_start(identicon_daemon_pool,
+                                   identicon_daemon_server);
+            break;
+        case APR_OC_REASON_RESTART:
+            apr_proc_other_child_unregister(data);
+            break;
+        case APR_OC_REASON_UNREGISTER:
+            kill(proc->pid, SIGHUP);
+            break;
+        default:
+            break;
+    }
+}
+#endif
+
+static int
+identicon_daemon_start(apr_pool_t *p, server_rec *s)
+{
+    apr_proc_t *proc;
+    apr_pool_t *pdaemon;
+    apr_interval_time_t delay = 0;
+    int ret;
+
+    /* back off after quick deaths: 1, 2, 4, ... seconds */
+    if (identicon_daemon_failures > 0) {
+        delay = apr_time_from_sec(1) << (identicon_daemon_failures - 1);
+        if (delay > apr_time_from_sec(IDENTICON_DAEMON_MAX_BACKOFF)) {
+            delay = apr_time_from_sec(IDENTICON_DAEMON_MAX_BACKOFF);
+        }
+    }
+
+    identicon_daemon_started = apr_time_now() + delay;
+
+    proc = apr_pcalloc(p, sizeof(apr_proc_t));
+
+    switch (apr_proc_fork(proc, p)) {
+        case APR_INCHILD:
+            /* wait in the daemon, not in the parent's maintenance */
+            if (delay > 0) {
+                apr_sleep(delay);
+            }
+
+            /* pconf cleanups belong to the parent */
+            if (apr_pool_create(&pdaemon, p) != APR_SUCCESS) {
+                exit(-1);
+            }
+            ret = identicon_daemon_main(pdaemon, s);
+            apr_pool_destroy(pdaemon);
+            exit(ret == 0 ? 0 : -1);
+        case APR_INPARENT:
+            apr_pool_note_subprocess(p, proc, APR_KILL_AFTER_TIMEOUT);
+#if APR_HAS_OTHER_CHILD
+            apr_proc_other_child_register(proc, identicon_daemon_maint,
+                                          proc, NULL, p);
+#endif
+            break;
+        default:
+            _SERR(s, "Failed to fork render daemon");
+            return -1;
+    }
+
+    return 0;
+}
+
+/* child: render through the daemon; -1 falls back to rendering in-process */
+static int
+identicon_daemon_render(request_rec *r, identicon_request_t *req,
+                        identicon_encode_t *enc, char **data, int *length)
+{
+    identicon_daemon_request_t msg;
+    identicon_daemon_response_t res;
+    struct sockaddr_un addr;
+    struct timeval tv;
+    char *buf;
+    int sd, ret = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.version = IDENTICON_DAEMON_VERSION;
+    msg.size = req->size;
+    msg.trans = req->trans;
+    msg.level = enc->level;
+    msg.palette = enc->palette;
+    msg.format = enc->format;
+    msg.user_len = strlen(req->user);
+
+    if (msg.user_len > IDENTICON_DAEMON_USER_MAX) {
+        return -1;
+    }
+
+    sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd < 0) {
+        return -1;
+    }
+
+    tv.tv_sec = IDENTICON_DAEMON_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    apr_cpystrn(addr.sun_path, identicon_daemon_sock, sizeof(addr.sun_path));
+
+    if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        identicon_sock_write(sd, &msg, sizeof(msg)) == 0 &&
+        identicon_sock_write(sd, req->user, msg.user_len) == 0 &&
+        identicon_sock_read(sd, &res, sizeof(res)) == 0 &&
+        res.status == 0 && res.length > 0 &&
+        res.length <= IDENTICON_DAEMON_DATA_MAX) {
+        buf = apr_palloc(r->pool, res.length);
+        if (identicon_sock_read(sd, buf, res.length) == 0) {
+            *data = buf;
+            *length = res.length;
+            ret = 0;
+        }
+    }
+
+    close(sd);
+
+    if (ret != 0) {
+        _RDEBUG(r, "render daemon unavailable: %s", identicon_daemon_sock);
+    }
+
+    return ret;
+}
+
+static char *
+socache_get(identicon_server_config_t *cfg, request_rec *r,
+            const char *key, int *length)
+{
+    void *data = NULL;
+    unsigned int data_len = IDENTICON_SOCACHE_MAX_SIZE;
+    apr_status_t rv;
+
+    if (!cfg->socache_instance) {
+        return NULL;
+    }
+
+    /*
+     * the entry size is unknown before the lookup: retrieve into a buffer
+     * reused by the requests of the connection (handled by one thread at
+     * a time), and copy out only the data
+     */
+    apr_pool_userdata_get(&data, IDENTICON_SOCACHE_BUFFER,
+                          r->connection->pool);
+    if (!data) {
+        data = apr_palloc(r->connection->pool, IDENTICON_SOCACHE_MAX_SIZE);
+        apr_pool_userdata_setn(data, IDENTICON_SOCACHE_BUFFER,
+                               apr_pool_cleanup_null,
+                               r->connection->pool);
+    }
+
+    IDENTICON_PROBE2(cache__lookup, "socache", key);
+
+    if (identicon_socache_mutex) {
+        apr_global_mutex_lock(identicon_socache_mutex);
+    }
+
+    rv = cfg->socache->retrieve(cfg->socache_instance, r->server,
+                                (const unsigned char *)key, strlen(key),
+                                (unsigned char *)data, &data_len, r->pool);
+
+    if (identicon_socache_mutex) {
+        apr_global_mutex_unlock(identicon_socache_mutex);
+    }
+
+    if (rv != APR_SUCCESS) {
+        IDENTICON_PROBE4(cache__result, "socache", key, 0, 0);
+        return NULL;
+    }
+
+    *length = (int)data_len;
+
+    IDENTICON_PROBE4(cache__result, "socache", key, 1, *length);
+
+    return apr_pmemdup(r->pool, data, data_len);
+}
+
+static void
+socache_set(identicon_server_config_t *cfg, request_rec *r,
+            const char *key, char *data, int length)
+{
+    apr_status_t rv;
+
+    if (!cfg->socache_instance || length > IDENTICON_SOCACHE_MAX_SIZE) {
+        return;
+    }
+
+    if (identicon_socache_mutex) {
+        apr_global_mutex_lock(identicon_socache_mutex);
+    }
+
+    rv = cfg->socache->store(cfg->socache_instance, r->server,
+                             (const unsigned char *)key, strlen(key),
+                             apr_time_now() + cfg->socache_expire,
+                             (unsigned char *)data, length, r->pool);
+
+    if (identicon_socache_mutex) {
+        apr_global_mutex_unlock(identicon_socache_mutex);
+    }
+
+    if (rv != APR_SUCCESS) {
+        _RDEBUG(r, "socache store failed: %s", key);
+    }
+}
+
+static apr_status_t
+socache_cleanup(void *parms)
+{
+    server_rec *s = (server_rec *)parms;
+    identicon_server_config_t *cfg;
+
+    cfg = ap_get_module_config(s->module_config, &identicon_module);
+
+    if (cfg->socache_instance) {
+        cfg->socache->destroy(cfg->socache_instance, s);
+        cfg->socache_instance = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+
+static char *
+identicon_cache_get(request_rec *r, const char *key, int *length)
+{
+    identicon_server_config_t *cfg;
+    char *data;
+#ifdef IDENTICON_HAVE_MEMCACHE
+    struct memcached_st *memc;
+    time_t expire;
+    char *ret;
+#endif
+
+    cfg = ap_get_module_config(r->server->module_config, &identicon_module);
+
+    data = identicon_local_get(identicon_local, r->pool, key, length);
+    if (data) {
+        return data;
+    }
+
+    data = socache_get(cfg, r, key, length);
+    if (data) {
+        identicon_local_set(identicon_local, key, data, *length);
+        return data;
+    }
+
+#ifdef IDENTICON_HAVE_MEMCACHE
+    memc = memcache_init(r, &expire);
+
+    /* memcache_get also polls for leases: probe the lookup here */
+    if (memc) {
+        IDENTICON_PROBE2(cache__lookup, "memcache", key);
+    }
+
+    ret = memcache_get(memc, key, length);
+
+    if (memc) {
+        IDENTICON_PROBE4(cache__result, "memcache", key, ret != NULL,
+                         ret ? *length : 0);
+    }
+
+    if (ret) {
+        data = apr_pmemdup(r->pool, ret, *length);
+        free(ret);
+
+        identicon_local_set(identicon_local, key, data, *length);
+        socache_set(cfg, r, key, data, *length);
+    }
+#endif
+
+    return data;
+}
+
+static void
+identicon_cache_set(request_rec *r, const char *key, char *data, int length,
+                    int admit)
+{
+    identicon_server_config_t *cfg;
+#ifdef IDENTICON_HAVE_MEMCACHE
+    struct memcached_st *memc;
+    time_t expire = 0;
+#endif
+
+    cfg = ap_get_module_config(r->server->module_config, &identicon_module);
+
+    IDENTICON_PROBE3(cache__store, key, length, admit);
+
+    if (admit & IDENTICON_ADMIT_LOCAL) {
+        identicon_local_set(identicon_local, key, data, length);
+    }
+
+    if (!(admit & IDENTICON_ADMIT_SHARED)) {
+        return;
+    }
+
+    socache_set(cfg, r, key, data, length);
+
+#ifdef IDENTICON_HAVE_MEMCACHE
+    memc = memcache_init(r, &expire);
+
+    memcache_set(memc, key, data, length, expire);
+#endif
+}
+
+/*
+ * Render every allowed size from one base image and cache the siblings,
+ * so that the follow-up requests of a srcset are hits.
+ */
+static int
+identicon_render_siblings(request_rec *r, identicon_server_config_t *cfg,
+                          identicon_request_t *req, identicon_encode_t *enc,
+                          int admit, char **data, int *length)
+{
+    identicon_image_t image;
+    char *out;
+    int i, out_len;
+    size_t size;
+
+    *data = NULL;
+
+    size = APR_ARRAY_IDX(cfg->sizes, cfg->sizes->nelts - 1, size_t);
+
+    if (identicon_render_base(&image, req->user,
+                              enc->parallel > 0 && size >= enc->parallel) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < cfg->sizes->nelts; i++) {
+        size = APR_ARRAY_IDX(cfg->sizes, i, size_t);
+
+        if (identicon_render_output(&image, size, req->trans, enc,
+                                    &out, &out_len) != 0) {
+            continue;
+        }
+
+        if (size == req->size) {
+            *data = out;
+            *length = out_len;
+        } else {
+            identicon_cache_set(r, identicon_format_key(r->pool, req->user,
+                                                        size, req->trans,
+                                                        req->format),
+                                out, out_len, admit);
+            gdFree(out);
+        }
+    }
+
+    identicon_image_destroy(&image);
+
+    if (!*data) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+identicon_render_acquire(identicon_server_config_t *cfg)
+{
+    if (apr_atomic_inc32(&identicon_renders) >= cfg->render_limit &&
+        cfg->render_limit > 0) {
+        apr_atomic_dec32(&identicon_renders);
+        return 0;
+    }
+
+    if (identicon_render_slot) {
+        apr_atomic_inc32(&identicon_render_slot->renders);
+        if (cfg->render_server_limit > 0 &&
+            identicon_server_renders() > cfg->render_server_limit) {
+            apr_atomic_dec32(&identicon_render_slot->renders);
+            apr_atomic_dec32(&identicon_renders);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void
+identicon_render_release(void)
+{
+    apr_atomic_dec32(&identicon_renders);
+
+    if (identicon_render_slot) {
+        apr_atomic_dec32(&identicon_render_slot->renders);
+    }
+
+    if (identicon_stats) {
+        apr_atomic_inc32(&identicon_stats->rendered);
+    }
+}
+
+/* answer without rendering when render concurrency is saturated */
+static int
+identicon_render_fallback(request_rec *r, identicon_server_config_t *cfg,
+                          identicon_request_t *req)
+{
+    char *data = NULL;
+    int i, length = 0;
+    size_t size;
+
+    if (identicon_stats) {
+        apr_atomic_inc32(&identicon_stats->rejected);
+    }
+
+    if (cfg->render_fallback == IDENTICON_FALLBACK_DEFAULT) {
+        data = identicon_cache_get(r, identicon_format_key(
+                                       r->pool, IDENTICON_DEFAULT_HASH,
+                                       req->size, req->trans, req->format),
+                                   &length);
+        if (data && identicon_stats) {
+            apr_atomic_inc32(&identicon_stats->fallback_default);
+        }
+    } else if (cfg->render_fallback == IDENTICON_FALLBACK_SMALLER &&
+               cfg->sizes) {
+        for (i = cfg->sizes->nelts - 1; i >= 0 && !data; i--) {
+            size = APR_ARRAY_IDX(cfg->sizes, i, size_t);
+            if (size >= req->size) {
+                continue;
+            }
+            data = identicon_cache_get(r, identicon_format_key(
+                                           r->pool, req->user, size,
+                                           req->trans, req->format),
+                                       &length);
+        }
+        if (data && identicon_stats) {
+            apr_atomic_inc32(&identicon_stats->fallback_smaller);
+        }
+    }
+
+    if (identicon_stats && !data) {
+        apr_atomic_inc32(&identicon_stats->fallback_busy);
+    }
+
+    /* not the image the ETag stands for */
+    apr_table_unset(r->headers_out, "ETag");
+    apr_table_setn(r->err_headers_out, "Cache-Control", "no-store");
+
+    if (!data) {
+        apr_table_setn(r->err_headers_out, "Retry-After",
+                       apr_itoa(r->pool, cfg->retry_after));
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    _RDEBUG(r, "render limit reached: fallback for %s", req->key);
+
+    ap_rwrite(data, length, r);
+
+    return OK;
+}
+
+/*
+ * Cache tiers, coalescing and render limit for one image. data is
+ * allocated from r->pool. Returns OK, HTTP_SERVICE_UNAVAILABLE when the
+ * render limit is reached, or HTTP_INTERNAL_SERVER_ERROR.
+ */
+static int
+identicon_produce(request_rec *r, identicon_server_config_t *cfg,
+                  identicon_request_t *req, char **image, int *image_len)
+{
+    char *key, *data = NULL, *rendered = NULL;
+    int length = 0, admitted = 1, fetched = 0, admit = IDENTICON_ADMIT_ALL;
+    identicon_encode_t enc;
+#if APR_HAS_THREADS
+    identicon_flight_t *flight = NULL;
+    int leader = 0;
+#endif
+#ifdef IDENTICON_HAVE_MEMCACHE
+    struct memcached_st *memc = NULL;
+    time_t expire = 0;
+    int leased = 0;
+#endif
+
+    key = req->key;
+
+    /* get cache */
+    data = identicon_cache_get(r, key, &length);
+
+    if (identicon_stats) {
+        apr_atomic_inc32(&identicon_stats->lookups);
+        if (data) {
+            apr_atomic_inc32(&identicon_stats->hits);
+        }
+    }
+
+    if (data) {
+        *image = data;
+        *image_len = length;
+        return OK;
+    }
+
+#ifdef IDENTICON_HAVE_MEMCACHE
+    /* memcache init */
+    memc = memcache_init(r, &expire);
+#endif
+
+#if APR_HAS_THREADS
+    /* wait for a render of the same key already running in this child */
+    if (cfg->coalesce) {
+        flight = identicon_flight_join(key, &leader);
+        if (flight && !leader) {
+            data = identicon_flight_wait(flight, r->pool,
+                                         cfg->coalesce_wait, &length);
+            identicon_flight_leave(flight);
+            flight = NULL;
+            if (data) {
+                *image = data;
+                *image_len = length;
+                return OK;
+            }
+        }
+    }
+#endif
+
+#ifdef IDENTICON_HAVE_MEMCACHE
+    /* wait for a render of the same key running in another child */
+    if (cfg->coalesce && memc) {
+        leased = memcache_lease(memc, r->pool, key, cfg->coalesce_wait);
+        if (!leased) {
+            data = memcache_wait(memc, r->pool, key,
+                                 cfg->coalesce_wait, &length);
+            if (data) {
+                /* keep it near: later hits skip memcached */
+                identicon_local_set(identicon_local, key, data, length);
+            }
+        }
+    }
+#endif
+
+    if (!data) {
+        admitted = identicon_render_acquire(cfg);
+    }
+
+    if (!data && admitted) {
+        admit = identicon_cache_admit(cfg, key);
+
+        identicon_encode_options(cfg, &enc, 0);
+        enc.format = req->format;
+
+        IDENTICON_PROBE3(render__start, key, req->size, req->format);
+
+        if (identicon_daemon_sock &&
+            identicon_daemon_render(r, req, &enc, &data, &length) == 0) {
+            fetched = 1;
+        } else if (cfg->siblings && cfg->sizes && cfg->sizes->nelts > 1 &&
+                   admit) {
+            /* siblings of a key that is not cached are not worth it */
+            if (identicon_render_siblings(r, cfg, req, &enc, admit,
+                                          &rendered, &length) == 0) {
+                data = rendered;
+            }
+        } else if (identicon_render(req->user, req->size, req->trans, &enc,
+                                    &rendered, &length) == 0) {
+            data = rendered;
+        }
+
+        IDENTICON_PROBE4(render__done, key, req->size, data ? length : 0,
+                         data ? 0 : -1);
+
+        identicon_render_release();
+    }
+
+#if APR_HAS_THREADS
+    if (flight) {
+        identicon_flight_finish(flight, data, length);
+        identicon_flight_leave(flight);
+    }
+#endif
+
+    if (!data) {
+#ifdef IDENTICON_HAVE_MEMCACHE
+        if (leased) {
+            memcache_release(memc, r->pool, key);
+        }
+#endif
+        if (!admitted) {
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (rendered || fetched) {
+        /* set cache */
+        identicon_cache_set(r, key, data, length, admit);
+#ifdef IDENTICON_HAVE_MEMCACHE
+        if (leased) {
+            memcache_release(memc, r->pool, key);
+        }
+#endif
+    }
+
+    if (rendered) {
+        data = apr_pmemdup(r->pool, rendered, length);
+        gdFree(rendered);
+    }
+
+    *image = data;
+    *image_len = length;
+
+    return OK;
+}
+
+/* content handler */
+static int
+identicon_handler(request_rec *r)
+{
+    identicon_server_config_t *cfg;
+    identicon_request_t *req;
+    char *data = NULL;
+    int length = 0, status;
+
+    if (strcmp(r->handler, "identicon")) {
+        return DECLINED;
+    }
+
+    if (r->header_only) {
+        return OK;
+    }
+
+    cfg = ap_get_module_config(r->server->module_config, &identicon_module);
+
+    /* set contest type */
+    r->content_type = IDENTICON_CONTENT_TYPE;
+
+    /* get parameter */
+    req = identicon_request(r, cfg);
+
+    IDENTICON_PROBE2(handler__entry, req->key, req->size);
+
+    if (req->format == IDENTICON_FORMAT_QOI) {
+        r->content_type = IDENTICON_QOI_CONTENT_TYPE;
+    } else if (req->format == IDENTICON_FORMAT_RGBA) {
+        r->content_type = IDENTICON_RGBA_CONTENT_TYPE;
+    }
+
+    if (identicon_not_modified(r, req)) {
+        status = HTTP_NOT_MODIFIED;
+    } else {
+        status = identicon_produce(r, cfg, req, &data, &length);
+        if (status == HTTP_SERVICE_UNAVAILABLE) {
+            status = identicon_render_fallback(r, cfg, req);
+        } else if (status == OK) {
+            ap_rwrite(data, length, r);
+        }
+    }
+
+    IDENTICON_PROBE4(handler__return, req->key, req->size, length, status);
+
+    return status;
+}
+
+/* optional function: see mod_identicon.h */
+static apr_status_t
+identicon_fetch(request_rec *r, const char *hash, apr_size_t size,
+                int flags, const char **data, apr_size_t *length)
+{
+    identicon_server_config_t *cfg;
+    identicon_request_t *req;
+    char *image = NULL;
+    int image_len = 0, status;
+
+    cfg = ap_get_module_config(r->server->module_config, &identicon_module);
+
+    req = apr_pcalloc(r->pool, sizeof(identicon_request_t));
+
+    if (!hash || strlen(hash) < 20) {
+        req->user = IDENTICON_DEFAULT_HASH;
+    } else {
+        req->user = apr_pstrdup(r->pool, hash);
+    }
+
+    req->size = identicon_size_snap(cfg, size ? size : IDENTICON_DEFAULT_SIZE);
+    req->trans = (flags & IDENTICON_FLAG_TRANSPARENT) ? 1 : 0;
+    req->format = IDENTICON_FORMAT_PNG;
+    req->key = identicon_cache_key(r->pool, req->user, req->size, req->trans);
+
+    identicon_sketch_record(req->key);
+
+    status = identicon_produce(r, cfg, req, &image, &image_len);
+    if (status == HTTP_SERVICE_UNAVAILABLE) {
+        return APR_EAGAIN;
+    } else if (status != OK) {
+        return APR_EGENERAL;
+    }
+
+    *data = image;
+    *length = (apr_size_t)image_len;
+
+    return APR_SUCCESS;
+}
+
+static int
+identicon_status_handler(request_rec *r)
+{
+    apr_uint32_t lookups, hits;
+
+    if (strcmp(r->handler, "identicon-status")) {
+        return DECLINED;
+    }
+
+    ap_set_content_type(r, IDENTICON_STATUS_CONTENT_TYPE);
+
+    if (r->header_only) {
+        return OK;
+    }
+
+    ap_rprintf(r, "ChildRenders: %u\n", apr_atomic_read32(&identicon_renders));
+
+    if (!identicon_stats) {
+        return OK;
+    }
+
+    ap_rprintf(r, "Renders: %u\n", identicon_server_renders());
+    ap_rprintf(r, "Rendered: %u\n",
+               apr_atomic_read32(&identicon_stats->rendered));
+    ap_rprintf(r, "RenderRejected: %u\n",
+               apr_atomic_read32(&identicon_stats->rejected));
+    ap_rprintf(r, "FallbackDefault: %u\n",
+               apr_atomic_read32(&identicon_stats->fallback_default));
+    ap_rprintf(r, "FallbackSmaller: %u\n",
+               apr_atomic_read32(&identicon_stats->fallback_smaller));
+    ap_rprintf(r, "FallbackBusy: %u\n",
+               apr_atomic_read32(&identicon_stats->fallback_busy));
+
+    lookups = apr_atomic_read32(&identicon_stats->lookups);
+    hits = apr_atomic_read32(&identicon_stats->hits);
+
+    ap_rprintf(r, "CacheLookups: %u\n", lookups);
+    ap_rprintf(r, "CacheHits: %u\n", hits);
+    ap_rprintf(r, "CacheHitRatio: %.3f\n",
+               lookups ? (double)hits / lookups : 0.0);
+    ap_rprintf(r, "CacheAdmitted: %u\n",
+               apr_atomic_read32(&identicon_stats->admitted));
+    ap_rprintf(r, "CacheRejected: %u\n",
+               apr_atomic_read32(&identicon_stats->admission_rejected));
+    ap_rprintf(r, "LocalCacheRejected: %u\n",
+               apr_atomic_read32(&identicon_stats->local_rejected));
+
+    return OK;
+}
+
+/* serve cache hits before the rest of the request pipeline */
+static int
+identicon_quick_handler(request_rec *r, int lookup)
+{
+    identicon_server_config_t *cfg;
+    identicon_request_t *req;
+    identicon_args_t args;
+    apr_size_t len;
+    char *data;
+    int length = 0;
+
+    cfg = ap_get_module_config(r->server->module_config, &identicon_module);
+
+    if (!cfg->quick_handler || lookup || r->main ||
+        r->method_number != M_GET || r->header_only || !r->uri) {
+        return DECLINED;
+    }
+
+    len = strlen(cfg->quick_handler);
+    if (strncmp(r->uri, cfg->quick_handler, len) != 0 ||
+        (r->uri[len] != '\0' && r->uri[len] != '/')) {
+        return DECLINED;
+    }
+
+    /* raw formats depend on the per-dir config, not merged yet */
+    identicon_args_parse(r->args, &args);
+    if (args.format != IDENTICON_FORMAT_PNG) {
+        return DECLINED;
+    }
+
+    req = identicon_request(r, cfg);
+
+    if (identicon_not_modified(r, req)) {
+        return HTTP_NOT_MODIFIED;
+    }
+
+    data = identicon_cache_get(r, req->key, &length);
+    if (!data) {
+        /* miss: render in the content handler */
+        return DECLINED;
+    }
+
+    _RDEBUG(r, "quick handler hit: %s", req->key);
+
+    IDENTICON_PROBE2(quick__hit, req->key, length);
+
+    /* misses are counted by the content handler */
+    if (identicon_stats) {
+        apr_atomic_inc32(&identicon_stats->lookups);
+        apr_atomic_inc32(&identicon_stats->hits);
+    }
+
+    ap_set_content_type(r, IDENTICON_CONTENT_TYPE);
+    ap_rwrite(data, length, r);
 
     return OK;
 }
 
-#ifdef IDENTICON_HAVE_MEMCACHE
-static void *
-identicon_create_server_config(apr_pool_t *p, server_rec *s)
+static void *
+identicon_create_dir_config(apr_pool_t *p, char *dir)
+{
+    identicon_dir_config_t *dcfg;
+
+    dcfg = apr_pcalloc(p, sizeof(identicon_dir_config_t));
+
+    dcfg->raw_formats = -1;
+
+    return (void *)dcfg;
+}
+
+static void *
+identicon_merge_dir_config(apr_pool_t *p, void *base_conf, void *add_conf)
+{
+    identicon_dir_config_t *dcfg, *base, *add;
+
+    dcfg = apr_pcalloc(p, sizeof(identicon_dir_config_t));
+    base = (identicon_dir_config_t *)base_conf;
+    add = (identicon_dir_config_t *)add_conf;
+
+    dcfg->raw_formats = add->raw_formats != -1 ?
+        add->raw_formats : base->raw_formats;
+
+    return (void *)dcfg;
+}
+
+static void *
+identicon_create_server_config(apr_pool_t *p, server_rec *s)
+{
+    identicon_server_config_t *cfg;
+
+    cfg = apr_pcalloc(p, sizeof(identicon_server_config_t));
+
+    memset(cfg, 0, sizeof(identicon_server_config_t));
+
+    cfg->coalesce = IDENTICON_DEFAULT_COALESCE;
+    cfg->coalesce_wait = apr_time_from_msec(IDENTICON_DEFAULT_COALESCE_WAIT);
+    cfg->sizes = NULL;
+    cfg->local_cache = IDENTICON_DEFAULT_LOCAL_CACHE;
+    cfg->warm_list = NULL;
+    cfg->snapshot = NULL;
+    cfg->warm = NULL;
+    cfg->quick_handler = NULL;
+    cfg->siblings = 0;
+    cfg->socache_name = NULL;
+    cfg->socache = NULL;
+    cfg->socache_instance = NULL;
+    cfg->socache_expire = apr_time_from_sec(IDENTICON_DEFAULT_CACHE_EXPIRE);
+    cfg->render_limit = 0;
+    cfg->render_server_limit = 0;
+    cfg->render_fallback = IDENTICON_FALLBACK_BUSY;
+    cfg->retry_after = IDENTICON_DEFAULT_RETRY_AFTER;
+    cfg->png_level = IDENTICON_PNG_DEFAULT;
+    cfg->png_palette = 0;
+    cfg->png_direct = 0;
+    cfg->admission = 0;
+    cfg->admission_min = IDENTICON_DEFAULT_ADMISSION_MIN;
+    cfg->render_threads = IDENTICON_DEFAULT_RENDER_THREADS;
+    cfg->parallel_size = IDENTICON_DEFAULT_PARALLEL_SIZE;
+    cfg->client_hints = 0;
+    cfg->daemon = NULL;
+    cfg->daemon_threads = IDENTICON_DEFAULT_DAEMON_THREADS;
+
+#ifdef IDENTICON_HAVE_MEMCACHE
+    apr_pool_create(&cfg->pool, p);
+
+    cfg->hosts = NULL;
+    cfg->expire = IDENTICON_DEFAULT_MEMCACHE_EXPIRE;
+    cfg->ketama = 0;
+    cfg->replicas = 0;
+    cfg->failure_limit = 0;
+    cfg->retry = IDENTICON_DEFAULT_MEMCACHE_RETRY;
+    cfg->binary = 0;
+    cfg->memc = NULL;
+    cfg->memc_pool = NULL;
+#endif
+
+    return (void *)cfg;
+}
+
+/*
+static void *
+identicon_merge_server_config(apr_pool_t *p, void *base_srv, void *override_srv)
+{
+    identicon_server_config_t *cfg, *base, *override;
+
+    cfg = apr_pcalloc(p, sizeof(identicon_server_config_t));
+    base = (identicon_server_config_t *)base_srv;
+    override  = (identicon_server_config_t *)override_srv;
+
+    cfg->pool = base->pool;
+
+    if (override->hosts) {
+        cfg->hosts = override->hosts;
+    } else {
+        cfg->hosts = NULL;
+    }
+
+    cfg->expire = override->expire;
+
+    return (void *)cfg;
+}
+*/
+
+#ifdef IDENTICON_HAVE_MEMCACHE
+static const char *
+identicon_memcache_set_host(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+
+    if (strlen(arg) == 0) {
+        return "MemcacheHost argument must be a string representing a hosts.";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->hosts = apr_pstrdup(parms->pool, arg);
+
+    return NULL;
+}
+
+static const char *
+identicon_memcache_set_expire(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    int expire;
+
+    if (sscanf(arg, "%d", &expire) != 1 || expire < 0) {
+        return "MemcacheExpire must be an integer representing the expire.";
+    }
+
+    cfg =(identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->expire = (time_t)expire;
+
+    return NULL;
+}
+
+static const char *
+identicon_memcache_set_distribution(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    if (strcasecmp(arg, "ketama") == 0) {
+        cfg->ketama = 1;
+    } else if (strcasecmp(arg, "modula") == 0) {
+        cfg->ketama = 0;
+    } else {
+        return "MemcacheDistribution must be one of modula or ketama.";
+    }
+
+    return NULL;
+}
+
+static const char *
+identicon_memcache_set_replicas(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    int replicas;
+
+    if (sscanf(arg, "%d", &replicas) != 1 || replicas < 0) {
+        return "MemcacheReplicas must be an integer representing the number "
+            "of replicas.";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->replicas = replicas;
+
+    return NULL;
+}
+
+static const char *
+identicon_memcache_set_failover(cmd_parms *parms, void *conf,
+                                char *arg1, char *arg2)
+{
+    identicon_server_config_t *cfg;
+    int limit, retry = IDENTICON_DEFAULT_MEMCACHE_RETRY;
+
+    if (sscanf(arg1, "%d", &limit) != 1 || limit < 0) {
+        return "MemcacheFailover must be an integer representing the number "
+            "of failures.";
+    }
+
+    if (arg2 && (sscanf(arg2, "%d", &retry) != 1 || retry < 0)) {
+        return "MemcacheFailover retry must be an integer representing "
+            "seconds.";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->failure_limit = limit;
+    cfg->retry = retry;
+
+    return NULL;
+}
+
+static const char *
+identicon_memcache_set_binary(cmd_parms *parms, void *conf, int flag)
+{
+    identicon_server_config_t *cfg;
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->binary = flag;
+
+    return NULL;
+}
+#endif
+
+static const char *
+identicon_set_coalesce(cmd_parms *parms, void *conf, int flag)
+{
+    identicon_server_config_t *cfg;
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->coalesce = flag;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_coalesce_wait(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    int wait;
+
+    if (sscanf(arg, "%d", &wait) != 1 || wait < 0) {
+        return "CoalesceWait must be an integer representing the milliseconds.";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->coalesce_wait = apr_time_from_msec(wait);
+
+    return NULL;
+}
+
+static const char *
+identicon_set_sizes(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    size_t size;
+    int i;
+
+    size = (size_t)atol(arg);
+    if (size == 0 || size > IDENTICON_MAX_SIZE) {
+        return "Sizes must be integers representing the image sizes "
+            "(1-100000).";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    if (!cfg->sizes) {
+        cfg->sizes = apr_array_make(parms->pool, 4, sizeof(size_t));
+    }
+
+    /* keep sorted */
+    APR_ARRAY_PUSH(cfg->sizes, size_t) = size;
+    for (i = cfg->sizes->nelts - 1;
+         i > 0 && APR_ARRAY_IDX(cfg->sizes, i - 1, size_t) > size; i--) {
+        APR_ARRAY_IDX(cfg->sizes, i, size_t) =
+            APR_ARRAY_IDX(cfg->sizes, i - 1, size_t);
+        APR_ARRAY_IDX(cfg->sizes, i - 1, size_t) = size;
+    }
+
+    return NULL;
+}
+
+static const char *
+identicon_set_local_cache(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    const char *err;
+    int entries;
+
+    err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+    if (err) {
+        return err;
+    }
+
+    if (sscanf(arg, "%d", &entries) != 1 || entries < 0) {
+        return "LocalCache must be an integer representing the entries.";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->local_cache = entries;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_warm_list(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    const char *err;
+
+    err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+    if (err) {
+        return err;
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->warm_list = ap_server_root_relative(parms->pool, arg);
+    if (!cfg->warm_list) {
+        return "WarmList must be a file path.";
+    }
+
+    return NULL;
+}
+
+static const char *
+identicon_set_quick_handler(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    apr_size_t len;
+
+    if (arg[0] != '/') {
+        return "QuickHandler must be a URL path (e.g. /identicon).";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->quick_handler = apr_pstrdup(parms->pool, arg);
+
+    /* match "/identicon" and "/identicon/..." */
+    len = strlen(cfg->quick_handler);
+    while (len > 1 && cfg->quick_handler[len - 1] == '/') {
+        cfg->quick_handler[--len] = '\0';
+    }
+
+    return NULL;
+}
+
+static const char *
+identicon_set_siblings(cmd_parms *parms, void *conf, int flag)
+{
+    identicon_server_config_t *cfg;
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->siblings = flag;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_cache(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    const char *name, *args, *err;
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    /* provider[:args] */
+    args = ap_strchr_c(arg, ':');
+    if (args) {
+        name = apr_pstrmemdup(parms->pool, arg, args - arg);
+        args++;
+    } else {
+        name = arg;
+    }
+
+    cfg->socache = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name,
+                                      AP_SOCACHE_PROVIDER_VERSION);
+    if (!cfg->socache) {
+        return apr_psprintf(parms->pool,
+                            "Unknown Cache provider '%s'; "
+                            "maybe you need to load mod_socache_%s?",
+                            name, name);
+    }
+
+    err = cfg->socache->create(&cfg->socache_instance, args,
+                               parms->temp_pool, parms->pool);
+    if (err) {
+        return apr_psprintf(parms->pool, "Cache '%s': %s", name, err);
+    }
+
+    cfg->socache_name = name;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_cache_expire(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    int expire;
+
+    if (sscanf(arg, "%d", &expire) != 1 || expire <= 0) {
+        return "CacheExpire must be a positive integer (seconds).";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->socache_expire = apr_time_from_sec(expire);
+
+    return NULL;
+}
+
+static const char *
+identicon_set_render_limit(cmd_parms *parms, void *conf,
+                           char *child, char *server)
+{
+    identicon_server_config_t *cfg;
+    int limit, server_limit = 0;
+
+    if (sscanf(child, "%d", &limit) != 1 || limit < 0 ||
+        (server && (sscanf(server, "%d", &server_limit) != 1 ||
+                    server_limit < 0))) {
+        return "RenderLimit must be integers representing the concurrent "
+            "renders per child and per server (0: unlimited).";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->render_limit = (apr_uint32_t)limit;
+    cfg->render_server_limit = (apr_uint32_t)server_limit;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_render_fallback(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    if (strcasecmp(arg, "busy") == 0) {
+        cfg->render_fallback = IDENTICON_FALLBACK_BUSY;
+    } else if (strcasecmp(arg, "default") == 0) {
+        cfg->render_fallback = IDENTICON_FALLBACK_DEFAULT;
+    } else if (strcasecmp(arg, "smaller") == 0) {
+        cfg->render_fallback = IDENTICON_FALLBACK_SMALLER;
+    } else {
+        return "RenderFallback must be one of busy, default or smaller.";
+    }
+
+    return NULL;
+}
+
+static const char *
+identicon_set_retry_after(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    int retry;
+
+    if (sscanf(arg, "%d", &retry) != 1 || retry < 0) {
+        return "RetryAfter must be an integer representing the seconds.";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->retry_after = retry;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_png_compression(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    int level;
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    if (strcasecmp(arg, "adaptive") == 0) {
+        cfg->png_level = IDENTICON_PNG_ADAPTIVE;
+    } else if (strcasecmp(arg, "default") == 0) {
+        cfg->png_level = IDENTICON_PNG_DEFAULT;
+    } else if (sscanf(arg, "%d", &level) == 1 && level >= 0 && level <= 9) {
+        cfg->png_level = level;
+    } else {
+        return "PngCompression must be 0-9, default or adaptive.";
+    }
+
+    return NULL;
+}
+
+static const char *
+identicon_set_png_palette(cmd_parms *parms, void *conf, int flag)
+{
+    identicon_server_config_t *cfg;
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->png_palette = flag;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_render_threads(cmd_parms *parms, void *conf, char *arg)
 {
     identicon_server_config_t *cfg;
+    const char *err;
+    int threads;
 
-    cfg = apr_pcalloc(p, sizeof(identicon_server_config_t));
+    err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+    if (err) {
+        return err;
+    }
 
-    memset(cfg, 0, sizeof(identicon_server_config_t));
+    if (sscanf(arg, "%d", &threads) != 1 || threads < 0 ||
+        threads > IDENTICON_MAX_RENDER_THREADS) {
+        return "RenderThreads must be an integer between 0 and 16.";
+    }
 
-    apr_pool_create(&cfg->pool, p);
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
 
-    cfg->hosts = NULL;
-    cfg->expire = IDENTICON_DEFAULT_MEMCACHE_EXPIRE;
-    cfg->memc = NULL;
-    cfg->servers = NULL;
+    cfg->render_threads = threads;
 
-    return (void *)cfg;
+    return NULL;
 }
-#endif
 
-/*
-static void *
-identicon_merge_server_config(apr_pool_t *p, void *base_srv, void *override_srv)
+static const char *
+identicon_set_parallel_size(cmd_parms *parms, void *conf, char *arg)
 {
-    identicon_server_config_t *cfg, *base, *override;
+    identicon_server_config_t *cfg;
+    int size;
 
-    cfg = apr_pcalloc(p, sizeof(identicon_server_config_t));
-    base = (identicon_server_config_t *)base_srv;
-    override  = (identicon_server_config_t *)override_srv;
+    if (sscanf(arg, "%d", &size) != 1 || size < 0) {
+        return "ParallelSize must be an integer representing the image size.";
+    }
 
-    cfg->pool = base->pool;
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
 
-    if (override->hosts) {
-        cfg->hosts = override->hosts;
-    } else {
-        cfg->hosts = NULL;
+    cfg->parallel_size = (size_t)size;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_client_hints(cmd_parms *parms, void *conf, int flag)
+{
+    identicon_server_config_t *cfg;
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->client_hints = flag;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_cache_snapshot(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    const char *err;
+
+    err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+    if (err) {
+        return err;
     }
 
-    cfg->expire = override->expire;
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
 
-    return (void *)cfg;
+    cfg->snapshot = ap_server_root_relative(parms->pool, arg);
+    if (!cfg->snapshot) {
+        return "CacheSnapshot must be a file path.";
+    }
+
+    return NULL;
 }
-*/
 
-#ifdef IDENTICON_HAVE_MEMCACHE
 static const char *
-identicon_memcache_set_host(cmd_parms *parms, void *conf, char *arg)
+identicon_set_daemon(cmd_parms *parms, void *conf, char *arg)
 {
     identicon_server_config_t *cfg;
+    const char *err;
 
-    if (strlen(arg) == 0) {
-        return "MemcacheHost argument must be a string representing a hosts.";
+    err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+    if (err) {
+        return err;
     }
 
     cfg = (identicon_server_config_t *)ap_get_module_config(
         parms->server->module_config, &identicon_module);
 
-    cfg->hosts = apr_pstrdup(parms->pool, arg);
+    cfg->daemon = ap_server_root_relative(parms->pool, arg);
+    if (!cfg->daemon) {
+        return "Daemon must be a socket path.";
+    }
+
+    if (strlen(cfg->daemon) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        return "Daemon socket path is too long.";
+    }
 
     return NULL;
 }
 
 static const char *
-identicon_memcache_set_expire(cmd_parms *parms, void *conf, char *arg)
+identicon_set_daemon_threads(cmd_parms *parms, void *conf, char *arg)
 {
     identicon_server_config_t *cfg;
-    int expire;
+    const char *err;
+    int threads;
 
-    if (sscanf(arg, "%d", &expire) != 1 || expire < 0) {
-        return "MemcacheExpire must be an integer representing the expire.";
+    err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+    if (err) {
+        return err;
     }
 
-    cfg =(identicon_server_config_t *)ap_get_module_config(
+    if (sscanf(arg, "%d", &threads) != 1 || threads <= 0) {
+        return "DaemonThreads must be a positive integer.";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
         parms->server->module_config, &identicon_module);
 
-    cfg->expire = (time_t)expire;
+    cfg->daemon_threads = threads;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_png_direct(cmd_parms *parms, void *conf, char *arg)
+{
+    identicon_server_config_t *cfg;
+    int size;
+
+    if (sscanf(arg, "%d", &size) != 1 || size < 0 ||
+        size > IDENTICON_PNG_DIRECT_MAX) {
+        return "PngDirect must be an integer between 0 and 1024.";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    cfg->png_direct = (size_t)size;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_admission(cmd_parms *parms, void *conf,
+                        char *arg1, char *arg2)
+{
+    identicon_server_config_t *cfg;
+    const char *err;
+    int width, min = IDENTICON_DEFAULT_ADMISSION_MIN;
+    apr_uint32_t size = 1;
+
+    err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+    if (err) {
+        return err;
+    }
+
+    if (sscanf(arg1, "%d", &width) != 1 || width < 0 ||
+        width > IDENTICON_SKETCH_MAX) {
+        return "Admission must be an integer representing the sketch width "
+            "(0 - 16777216).";
+    }
+
+    if (arg2 && (sscanf(arg2, "%d", &min) != 1 || min < 1)) {
+        return "Admission frequency must be a positive integer.";
+    }
+
+    cfg = (identicon_server_config_t *)ap_get_module_config(
+        parms->server->module_config, &identicon_module);
+
+    /* power of two */
+    if (width > 0) {
+        while (size < (apr_uint32_t)width) {
+            size <<= 1;
+        }
+        cfg->admission = size;
+    } else {
+        cfg->admission = 0;
+    }
+    cfg->admission_min = min;
+
+    return NULL;
+}
+
+static const char *
+identicon_set_raw_formats(cmd_parms *parms, void *conf, int flag)
+{
+    identicon_dir_config_t *dcfg = (identicon_dir_config_t *)conf;
+
+    dcfg->raw_formats = flag;
 
     return NULL;
 }
-#endif
 
 static const command_rec
 identicon_cmds[] = {
@@ -1079,26 +5488,397 @@ identicon_cmds[] = {
     AP_INIT_TAKE1("IdenticonMemcacheExpire",
                   (const char*(*)())(identicon_memcache_set_expire), NULL,
                   RSRC_CONF, "identicon memcache expire"),
+    AP_INIT_TAKE1("IdenticonMemcacheDistribution",
+                  (const char*(*)())(identicon_memcache_set_distribution),
+                  NULL, RSRC_CONF,
+                  "identicon memcache key distribution (modula, ketama)"),
+    AP_INIT_TAKE1("IdenticonMemcacheReplicas",
+                  (const char*(*)())(identicon_memcache_set_replicas), NULL,
+                  RSRC_CONF, "identicon memcache replicas"),
+    AP_INIT_TAKE12("IdenticonMemcacheFailover",
+                   (const char*(*)())(identicon_memcache_set_failover), NULL,
+                   RSRC_CONF, "identicon memcache failure limit and retry "
+                   "interval (sec) of ejected servers"),
+    AP_INIT_FLAG("IdenticonMemcacheBinary",
+                 (const char*(*)())(identicon_memcache_set_binary), NULL,
+                 RSRC_CONF, "identicon memcache binary protocol"),
 #endif
+    AP_INIT_FLAG("IdenticonCoalesce",
+                 (const char*(*)())(identicon_set_coalesce), NULL,
+                 RSRC_CONF, "identicon coalesce concurrent renders"),
+    AP_INIT_TAKE1("IdenticonCoalesceWait",
+                  (const char*(*)())(identicon_set_coalesce_wait), NULL,
+                  RSRC_CONF, "identicon coalesce wait (msec)"),
+    AP_INIT_ITERATE("IdenticonSizes",
+                    (const char*(*)())(identicon_set_sizes), NULL,
+                    RSRC_CONF, "identicon allowed image sizes"),
+    AP_INIT_TAKE1("IdenticonLocalCache",
+                  (const char*(*)())(identicon_set_local_cache), NULL,
+                  RSRC_CONF, "identicon per-child cache entries"),
+    AP_INIT_TAKE1("IdenticonWarmList",
+                  (const char*(*)())(identicon_set_warm_list), NULL,
+                  RSRC_CONF, "identicon warm list file"),
+    AP_INIT_TAKE1("IdenticonQuickHandler",
+                  (const char*(*)())(identicon_set_quick_handler), NULL,
+                  RSRC_CONF, "identicon quick handler location"),
+    AP_INIT_FLAG("IdenticonRenderSiblings",
+                 (const char*(*)())(identicon_set_siblings), NULL,
+                 RSRC_CONF, "identicon render all allowed sizes on a miss"),
+    AP_INIT_TAKE1("IdenticonCache",
+                  (const char*(*)())(identicon_set_cache), NULL,
+                  RSRC_CONF, "identicon socache provider (provider[:args])"),
+    AP_INIT_TAKE1("IdenticonCacheExpire",
+                  (const char*(*)())(identicon_set_cache_expire), NULL,
+                  RSRC_CONF, "identicon socache expire (sec)"),
+    AP_INIT_TAKE12("IdenticonRenderLimit",
+                   (const char*(*)())(identicon_set_render_limit), NULL,
+                   RSRC_CONF, "identicon concurrent renders per child "
+                   "[and per server]"),
+    AP_INIT_TAKE1("IdenticonRenderFallback",
+                  (const char*(*)())(identicon_set_render_fallback), NULL,
+                  RSRC_CONF, "identicon response over the render limit "
+                  "(busy, default, smaller)"),
+    AP_INIT_TAKE1("IdenticonRetryAfter",
+                  (const char*(*)())(identicon_set_retry_after), NULL,
+                  RSRC_CONF, "identicon Retry-After of busy responses (sec)"),
+    AP_INIT_TAKE1("IdenticonPngCompression",
+                  (const char*(*)())(identicon_set_png_compression), NULL,
+                  RSRC_CONF, "identicon png compression level "
+                  "(0-9, default, adaptive)"),
+    AP_INIT_FLAG("IdenticonPngPalette",
+                 (const char*(*)())(identicon_set_png_palette), NULL,
+                 RSRC_CONF, "identicon png palette (unfiltered) encoding"),
+    AP_INIT_TAKE1("IdenticonPngDirect",
+                  (const char*(*)())(identicon_set_png_direct), NULL,
+                  RSRC_CONF, "identicon max image size encoded without "
+                  "libpng"),
+    AP_INIT_TAKE1("IdenticonRenderThreads",
+                  (const char*(*)())(identicon_set_render_threads), NULL,
+                  RSRC_CONF, "identicon per-child render threads"),
+    AP_INIT_TAKE1("IdenticonParallelSize",
+                  (const char*(*)())(identicon_set_parallel_size), NULL,
+                  RSRC_CONF, "identicon image size rendered in parallel"),
+    AP_INIT_TAKE1("IdenticonDaemon",
+                  (const char*(*)())(identicon_set_daemon), NULL,
+                  RSRC_CONF, "identicon render daemon socket"),
+    AP_INIT_TAKE1("IdenticonDaemonThreads",
+                  (const char*(*)())(identicon_set_daemon_threads), NULL,
+                  RSRC_CONF, "identicon render daemon threads"),
+    AP_INIT_FLAG("IdenticonRawFormats",
+                 (const char*(*)())(identicon_set_raw_formats), NULL,
+                 ACCESS_CONF, "identicon qoi and rgba output (f parameter)"),
+    AP_INIT_TAKE12("IdenticonAdmission",
+                   (const char*(*)())(identicon_set_admission), NULL,
+                   RSRC_CONF, "identicon cache admission sketch width and "
+                   "min frequency"),
+    AP_INIT_TAKE1("IdenticonCacheSnapshot",
+                  (const char*(*)())(identicon_set_cache_snapshot), NULL,
+                  RSRC_CONF, "identicon local cache snapshot file"),
+    AP_INIT_FLAG("IdenticonClientHints",
+                 (const char*(*)())(identicon_set_client_hints), NULL,
+                 RSRC_CONF, "identicon size from client hints"),
     {NULL}
 };
 
+static int
+identicon_pre_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    if (ap_mutex_register(p, IDENTICON_SOCACHE_MUTEX, NULL,
+                          APR_LOCK_DEFAULT, 0) != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return OK;
+}
+
+static int
+identicon_socache_init(apr_pool_t *p, server_rec *s)
+{
+    identicon_server_config_t *cfg;
+    struct ap_socache_hints hints;
+    server_rec *vs;
+    apr_status_t rv;
+
+    hints.avg_id_len = 32;
+    hints.avg_obj_size = 2048;
+    hints.expiry_interval = 60;
+
+    for (vs = s; vs; vs = vs->next) {
+        cfg = ap_get_module_config(vs->module_config, &identicon_module);
+        if (!cfg->socache_instance) {
+            continue;
+        }
+
+        if ((cfg->socache->flags & AP_SOCACHE_FLAG_NOTMPSAFE) &&
+            !identicon_socache_mutex) {
+            rv = ap_global_mutex_create(&identicon_socache_mutex, NULL,
+                                        IDENTICON_SOCACHE_MUTEX, NULL,
+                                        s, p, 0);
+            if (rv != APR_SUCCESS) {
+                _SERR(vs, "Failed to create cache mutex");
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+
+        rv = cfg->socache->init(cfg->socache_instance, "mod_identicon",
+                                &hints, vs, p);
+        if (rv != APR_SUCCESS) {
+            _SERR(vs, "Failed to initialise cache: %s", cfg->socache_name);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        apr_pool_cleanup_register(p, (void *)vs, socache_cleanup,
+                                  apr_pool_cleanup_null);
+    }
+
+    return OK;
+}
+
+static int
+identicon_sketch_init(apr_pool_t *p, server_rec *s,
+                      identicon_server_config_t *cfg)
+{
+    apr_shm_t *shm;
+    apr_status_t rv;
+    apr_size_t size;
+    const char *fname;
+
+    identicon_sketch = NULL;
+    identicon_sketch_counters = NULL;
+
+    if (cfg->admission == 0) {
+        return OK;
+    }
+
+    size = sizeof(identicon_sketch_t) +
+        sizeof(apr_uint32_t) * cfg->admission * IDENTICON_SKETCH_DEPTH;
+
+    rv = apr_shm_create(&shm, size, NULL, p);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        fname = ap_runtime_dir_relative(p, "identicon-sketch.shm");
+        apr_shm_remove(fname, p);
+        rv = apr_shm_create(&shm, size, fname, p);
+    }
+
+    if (rv != APR_SUCCESS) {
+        _SERR(s, "Failed to create shared memory for cache admission");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    identicon_sketch = (identicon_sketch_t *)apr_shm_baseaddr_get(shm);
+    memset(identicon_sketch, 0, size);
+    identicon_sketch->width = cfg->admission;
+    identicon_sketch->cursor = cfg->admission * IDENTICON_SKETCH_DEPTH;
+    identicon_sketch_counters = (apr_uint32_t *)(identicon_sketch + 1);
+
+    return OK;
+}
+
+static int
+identicon_stats_init(apr_pool_t *p, server_rec *s)
+{
+    apr_shm_t *shm;
+    apr_status_t rv;
+    apr_size_t size;
+    const char *fname;
+    int slots = 0;
+
+    /* one render slot per scoreboard slot */
+    ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &slots);
+    if (slots <= 0) {
+        slots = 1;
+    }
+
+    size = APR_ALIGN_DEFAULT(sizeof(identicon_stats_t)) +
+        slots * sizeof(identicon_render_slot_t);
+
+    rv = apr_shm_create(&shm, size, NULL, p);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        /* no anonymous shared memory: use a file */
+        fname = ap_runtime_dir_relative(p, "identicon.shm");
+        apr_shm_remove(fname, p);
+        rv = apr_shm_create(&shm, size, fname, p);
+    }
+
+    if (rv != APR_SUCCESS) {
+        _SERR(s, "Failed to create shared memory for statistics");
+        identicon_stats = NULL;
+        identicon_render_slots = NULL;
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    identicon_stats = (identicon_stats_t *)apr_shm_baseaddr_get(shm);
+    memset(identicon_stats, 0, size);
+    identicon_stats->slots = slots;
+
+    identicon_render_slots = (identicon_render_slot_t *)
+        ((char *)identicon_stats +
+         APR_ALIGN_DEFAULT(sizeof(identicon_stats_t)));
+
+    return OK;
+}
+
+static apr_status_t
+identicon_render_slot_cleanup(void *parms)
+{
+    identicon_render_slot_t *slot = (identicon_render_slot_t *)parms;
+
+    apr_atomic_set32(&slot->renders, 0);
+    apr_atomic_set32(&slot->pid, 0);
+
+    identicon_render_slot = NULL;
+
+    return APR_SUCCESS;
+}
+
+/* claim a render slot for this child, released when it exits */
+static void
+identicon_render_slot_init(apr_pool_t *p, server_rec *s)
+{
+    apr_uint32_t i, pid = (apr_uint32_t)getpid();
+
+    if (!identicon_stats) {
+        return;
+    }
+
+    for (i = 0; i < identicon_stats->slots; i++) {
+        if (apr_atomic_cas32(&identicon_render_slots[i].pid, pid, 0) == 0) {
+            identicon_render_slot = &identicon_render_slots[i];
+            apr_atomic_set32(&identicon_render_slot->renders, 0);
+            apr_pool_cleanup_register(p, identicon_render_slot,
+                                      identicon_render_slot_cleanup,
+                                      apr_pool_cleanup_null);
+            return;
+        }
+    }
+
+    _SERR(s, "No render slot left: IdenticonRenderServerLimit "
+          "does not count this child");
+}
+
+/* parent: drop the renders of a child that died while rendering */
+static void
+identicon_child_status(server_rec *s, pid_t pid, ap_generation_t gen,
+                       int slot, mpm_child_status status)
+{
+    apr_uint32_t i;
+
+    if (status != MPM_CHILD_EXITED || !identicon_stats) {
+        return;
+    }
+
+    /* a child that died without saving frees the snapshot claim */
+    apr_atomic_cas32(&identicon_stats->snapshot_pid, 0, (apr_uint32_t)pid);
+
+    for (i = 0; i < identicon_stats->slots; i++) {
+        if (apr_atomic_read32(&identicon_render_slots[i].pid)
+            == (apr_uint32_t)pid) {
+            apr_atomic_set32(&identicon_render_slots[i].renders, 0);
+            apr_atomic_set32(&identicon_render_slots[i].pid, 0);
+        }
+    }
+}
+
+static int
+identicon_post_config(apr_pool_t *p, apr_pool_t *plog,
+                      apr_pool_t *ptemp, server_rec *s)
+{
+    identicon_server_config_t *cfg;
+    void *data = NULL;
+    const char *userdata_key = "identicon_post_config";
+
+    /* skip the first (config check) pass */
+    apr_pool_userdata_get(&data, userdata_key, s->process->pool);
+    if (!data) {
+        apr_pool_userdata_set((const void *)1, userdata_key,
+                              apr_pool_cleanup_null, s->process->pool);
+        return OK;
+    }
+
+    cfg = ap_get_module_config(s->module_config, &identicon_module);
+
+    if (identicon_socache_init(p, s) != OK ||
+        identicon_stats_init(p, s) != OK ||
+        identicon_sketch_init(p, s, cfg) != OK) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (identicon_warm_load(cfg, p, s) != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* shared caches: warm once for all children */
+    identicon_warm_socache(cfg, ptemp, s);
+#ifdef IDENTICON_HAVE_MEMCACHE
+    identicon_warm_memcache(cfg, ptemp);
+#endif
+
+    identicon_daemon_sock = cfg->daemon;
+    identicon_daemon_failures = 0;
+    identicon_daemon_pool = p;
+    identicon_daemon_server = s;
+
+    if (identicon_daemon_sock && identicon_daemon_start(p, s) != 0) {
+        /* render in the children */
+        identicon_daemon_sock = NULL;
+    }
+
+    return OK;
+}
+
+static void
+identicon_child_init(apr_pool_t *p, server_rec *s)
+{
+    identicon_server_config_t *cfg;
+
+    cfg = ap_get_module_config(s->module_config, &identicon_module);
+
+    if (identicon_socache_mutex) {
+        if (apr_global_mutex_child_init(&identicon_socache_mutex,
+                apr_global_mutex_lockfile(identicon_socache_mutex),
+                p) != APR_SUCCESS) {
+            _SERR(s, "Failed to reopen cache mutex");
+        }
+    }
+
+    identicon_render_slot_init(p, s);
+
+#ifdef IDENTICON_HAVE_MEMCACHE
+    memcache_child_init(p, s);
+#endif
+
+    if (identicon_process_init(p, s, cfg) != 0) {
+        return;
+    }
+
+    /* with the render daemon, the daemon owns the cache */
+    if (cfg->local_cache <= 0 || identicon_daemon_sock) {
+        return;
+    }
+
+    identicon_local_init(p, s, cfg, cfg->local_cache);
+}
+
 static void
 identicon_register_hooks(apr_pool_t *p)
 {
+    ap_hook_pre_config(identicon_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(identicon_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(identicon_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_status(identicon_child_status, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_quick_handler(identicon_quick_handler, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_handler(identicon_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(identicon_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+
+    APR_REGISTER_OPTIONAL_FN(identicon_fetch);
 }
 
 module AP_MODULE_DECLARE_DATA identicon_module =
 {
     STANDARD20_MODULE_STUFF,
-    NULL,                           /* create per-dir    config structures */
-    NULL,                           /* merge  per-dir    config structures */
-#ifdef IDENTICON_HAVE_MEMCACHE
+    identicon_create_dir_config,    /* create per-dir    config structures */
+    identicon_merge_dir_config,     /* merge  per-dir    config structures */
     identicon_create_server_config, /* create per-server config structures */
-#else
-    NULL,
-#endif
     NULL,                           /* merge  per-server config structures */
     /* identicon_merge_server_config, */
     identicon_cmds,                 /* table of config file commands       */
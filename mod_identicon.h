@@ -0,0 +1,43 @@
+/*
+**  mod_identicon.h -- Apache identicon module API
+**
+**  Other modules can get identicon images without an HTTP round trip:
+**
+**    #include "mod_identicon.h"
+**
+**    APR_OPTIONAL_FN_TYPE(identicon_fetch) *fetch;
+**    const char *data;
+**    apr_size_t length;
+**
+**    fetch = APR_RETRIEVE_OPTIONAL_FN(identicon_fetch);
+**    if (fetch && fetch(r, hash, 64, 0, &data, &length) == APR_SUCCESS) {
+**        ...
+**    }
+*/
+
+#ifndef MOD_IDENTICON_H
+#define MOD_IDENTICON_H
+
+#include "httpd.h"
+#include "apr_optional.h"
+
+/* flags */
+#define IDENTICON_FLAG_TRANSPARENT 0x01
+
+/*
+ * Get a png image through the same caches, request coalescing and render
+ * limit as the identicon handler, with the configuration of r->server.
+ *
+ *   hash:   md5 hex string (shorter than 20 chars: the default image)
+ *   size:   pixels (0: default), snapped to IdenticonSizes
+ *   flags:  IDENTICON_FLAG_*
+ *   data:   png image, allocated from r->pool
+ *
+ * Returns APR_SUCCESS, APR_EAGAIN when IdenticonRenderLimit is reached,
+ * or APR_EGENERAL.
+ */
+APR_DECLARE_OPTIONAL_FN(apr_status_t, identicon_fetch,
+                        (request_rec *r, const char *hash, apr_size_t size,
+                         int flags, const char **data, apr_size_t *length));
+
+#endif /* MOD_IDENTICON_H */
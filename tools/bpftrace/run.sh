@@ -0,0 +1,27 @@
+#!/bin/bash
+#
+# Run a bpftrace script against mod_identicon (built with sys/sdt.h
+# available). Every httpd child and the render daemon is traced.
+#
+#   tools/bpftrace/run.sh SCRIPT [MODULE]
+#
+# MODULE defaults to mod_identicon.so in the apxs LIBEXECDIR.
+
+set -e
+
+APXS=${APXS:-apxs}
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 SCRIPT [MODULE]" >&2
+    exit 1
+fi
+
+SCRIPT=$1
+MODULE=${2:-$(${APXS} -q LIBEXECDIR)/mod_identicon.so}
+
+if [ ! -f "${MODULE}" ]; then
+    echo "$0: ${MODULE} not found" >&2
+    exit 1
+fi
+
+exec bpftrace -e "$(sed -e "s|@MODULE@|${MODULE}|g" ${SCRIPT})"